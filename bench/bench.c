@@ -0,0 +1,528 @@
+/*
+    allocator benchmark suite
+
+      build/bench [-b backend]... [-t threads] [-s scale] [-n] [-p] [workload]...
+
+      -b: kalloc | kalloc-cpu | glibc (default: all)
+      -t: worker threads (default: CPU_NUM)
+      -s: iteration scale (default: 1)
+      -n: do not print the table header
+      -p: add cache event counts per operation (see bench/counters.h)
+
+    compile options:
+      -DBKL:  serialize kalloc/kfree behind a big kernel lock (backend kalloc-bkl)
+      -DLOCK_STAT: after each run, print the lock class table of spinlock.h
+                   to stderr
+
+    every (workload, backend) pair runs in a forked child so that the peak RSS
+    reported by wait4() belongs to that pair alone. one tab separated row is
+    printed per run:
+
+      workload  backend  threads  ops  seconds  ops_per_sec  peak_rss_kb
+
+    with -p, three columns follow: L1D read misses, LLC references and LLC
+    misses per operation. a line another core holds dirty is an L1D miss
+    that hits the LLC or a remote cache, so false sharing shows up as
+    l1d_miss/op rising while llc_miss/op stays flat. "-" marks a counter the
+    machine does not provide (common in VMs).
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../pmm.h"
+#include "counters.h"
+
+#define MAX_THREADS 64
+#define CACHELINE 64
+
+// ============== backends ===============
+
+struct backend {
+  const char *name;
+  void (*init)();
+  void *(*alloc)(int tid, size_t size);
+  void (*free)(int tid, void *ptr);
+};
+
+#ifdef BKL
+spinlock_t big_kernel_lk = (spinlock_t) {.locked = 0};
+
+static void *bkl_kalloc(int tid, size_t size) {
+  spin_lock(&big_kernel_lk);
+  void *p = kalloc(tid, size);
+  spin_unlock(&big_kernel_lk);
+  return p;
+}
+
+static void bkl_kfree(int tid, void *ptr) {
+  spin_lock(&big_kernel_lk);
+  kfree(tid, ptr);
+  spin_unlock(&big_kernel_lk);
+}
+#endif
+
+// picks the heap of the current CPU instead of the worker's index
+static void *cur_kalloc(int tid, size_t size) {
+  return kalloc_cur(size);
+}
+
+static void cur_kfree(int tid, void *ptr) {
+  kfree_cur(ptr);
+}
+
+static void glibc_init() {}
+
+static void *glibc_malloc(int tid, size_t size) {
+  return malloc(size);
+}
+
+static void glibc_free(int tid, void *ptr) {
+  free(ptr);
+}
+
+static struct backend backends[] = {
+#ifdef BKL
+  { "kalloc-bkl", pmm_init, bkl_kalloc, bkl_kfree },
+#else
+  { "kalloc", pmm_init, kalloc, kfree },
+  { "kalloc-cpu", pmm_init, cur_kalloc, cur_kfree },
+#endif
+  { "glibc", glibc_init, glibc_malloc, glibc_free },
+};
+
+#define NR_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+// ============== harness ===============
+
+static struct backend *be;
+static int nthreads;
+static int scale = 1;
+static int use_counters;
+static pthread_barrier_t barrier;
+
+struct worker {
+  int idx;
+  pthread_t thread;
+  uint64_t seed;
+  uint64_t ops;
+  struct timespec start, end;
+} __attribute__((aligned(CACHELINE)));
+
+static struct worker workers[MAX_THREADS];
+
+static inline uint64_t xorshift(uint64_t *s) {
+  uint64_t x = *s;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *s = x;
+}
+
+static inline size_t rand_size(struct worker *w, size_t min_sz, size_t max_sz) {
+  return min_sz + xorshift(&w->seed) % (max_sz - min_sz + 1);
+}
+
+static inline int cpu_of(struct worker *w) {
+  return w->idx % CPU_NUM;
+}
+
+static inline void *b_alloc(struct worker *w, size_t size) {
+  void *p = be->alloc(cpu_of(w), size);
+  assert(p != NULL);
+  w->ops++;
+  return p;
+}
+
+static inline void b_free(struct worker *w, void *ptr) {
+  be->free(cpu_of(w), ptr);
+  w->ops++;
+}
+
+// ============== larson ===============
+// server churn: every thread replaces random slots of an array with blocks of
+// random size. between rounds the arrays rotate to the next thread, so most
+// frees release blocks that another thread allocated.
+
+#define LARSON_SLOTS 1024
+#define LARSON_ROUNDS 16
+
+static void *larson_slots[MAX_THREADS][LARSON_SLOTS];
+
+static void larson_body(struct worker *w) {
+  void **slots = larson_slots[w->idx];
+  for (int i = 0; i < LARSON_SLOTS; i++)
+    slots[i] = b_alloc(w, rand_size(w, 8, 1000));
+  for (int r = 0; r < LARSON_ROUNDS; r++) {
+    pthread_barrier_wait(&barrier);
+    slots = larson_slots[(w->idx + r) % nthreads];
+    for (int i = 0; i < 4 * LARSON_SLOTS * scale; i++) {
+      int k = xorshift(&w->seed) % LARSON_SLOTS;
+      b_free(w, slots[k]);
+      slots[k] = b_alloc(w, rand_size(w, 8, 1000));
+    }
+  }
+  pthread_barrier_wait(&barrier);
+  slots = larson_slots[w->idx];
+  for (int i = 0; i < LARSON_SLOTS; i++)
+    b_free(w, slots[i]);
+}
+
+// ============== threadtest ===============
+// every thread allocates a batch of equal sized objects and frees the batch.
+
+#define THREADTEST_BATCH 1024
+#define THREADTEST_ROUNDS 128
+
+static void threadtest_body(struct worker *w) {
+  void *batch[THREADTEST_BATCH];
+  for (int r = 0; r < THREADTEST_ROUNDS * scale; r++) {
+    for (int i = 0; i < THREADTEST_BATCH; i++)
+      batch[i] = b_alloc(w, 64);
+    for (int i = 0; i < THREADTEST_BATCH; i++)
+      b_free(w, batch[i]);
+  }
+}
+
+// ============== xmalloc ===============
+// producer/consumer: even threads allocate and hand the blocks to their odd
+// neighbour through a bounded ring, which frees them. an unpaired thread
+// produces and consumes by itself.
+
+#define XMALLOC_RING 4096
+#define XMALLOC_OBJS (1 << 17)
+
+struct xring {
+  spinlock_t lk;
+  int head, tail;
+  void *slot[XMALLOC_RING];
+} __attribute__((aligned(CACHELINE)));
+
+static struct xring xrings[MAX_THREADS / 2 + 1];
+
+static int xring_push(struct xring *q, void *p) {
+  int ok = 0;
+  spin_lock(&q->lk);
+  if (q->tail - q->head < XMALLOC_RING) {
+    q->slot[q->tail++ % XMALLOC_RING] = p;
+    ok = 1;
+  }
+  spin_unlock(&q->lk);
+  return ok;
+}
+
+static void *xring_pop(struct xring *q) {
+  void *p = NULL;
+  spin_lock(&q->lk);
+  if (q->head != q->tail)
+    p = q->slot[q->head++ % XMALLOC_RING];
+  spin_unlock(&q->lk);
+  return p;
+}
+
+static void xmalloc_body(struct worker *w) {
+  struct xring *q = &xrings[w->idx / 2];
+  int total = XMALLOC_OBJS * scale;
+  if ((w->idx ^ 1) >= nthreads) {
+    for (int i = 0; i < total; i += XMALLOC_RING) {
+      for (int j = i; j < total && j < i + XMALLOC_RING; j++)
+        xring_push(q, b_alloc(w, rand_size(w, 16, 256)));
+      for (void *p; (p = xring_pop(q)) != NULL; )
+        b_free(w, p);
+    }
+  }
+  else if (w->idx % 2 == 0) {
+    for (int i = 0; i < total; i++) {
+      void *p = b_alloc(w, rand_size(w, 16, 256));
+      while (!xring_push(q, p))
+        sched_yield();
+    }
+  }
+  else {
+    for (int i = 0; i < total; i++) {
+      void *p;
+      while ((p = xring_pop(q)) == NULL)
+        sched_yield();
+      b_free(w, p);
+    }
+  }
+}
+
+// ============== cache-scratch / cache-thrash ===============
+// small objects written over and over. cache-thrash lets every thread
+// allocate its own (active false sharing); cache-scratch first hands every
+// thread an object allocated by thread 0 and freed by the receiver, so an
+// allocator that recycles it locally keeps sharing a line with thread 0
+// (passive false sharing).
+
+#define CACHE_OBJ_SZ 8
+#define CACHE_ITERS (1 << 15)
+#define CACHE_WRITES 256
+
+static void *scratch_objs[MAX_THREADS];
+
+static void cache_loop(struct worker *w) {
+  for (int i = 0; i < CACHE_ITERS * scale; i++) {
+    volatile char *p = b_alloc(w, CACHE_OBJ_SZ);
+    for (int j = 0; j < CACHE_WRITES; j++)
+      for (int k = 0; k < CACHE_OBJ_SZ; k++)
+        p[k]++;
+    b_free(w, (void *)p);
+  }
+}
+
+static void cache_scratch_setup() {
+  struct worker w0 = { .idx = 0 };
+  for (int i = 0; i < nthreads; i++)
+    scratch_objs[i] = be->alloc(cpu_of(&w0), CACHE_OBJ_SZ);
+}
+
+static void cache_scratch_body(struct worker *w) {
+  b_free(w, scratch_objs[w->idx]);
+  cache_loop(w);
+}
+
+static void cache_thrash_body(struct worker *w) {
+  cache_loop(w);
+}
+
+// ============== list / tree ===============
+// data structure build and teardown: a linked list freed front to back and a
+// random binary search tree freed in post order.
+
+#define LIST_NODES (1 << 16)
+#define TREE_NODES (1 << 15)
+
+struct list_node {
+  struct list_node *next;
+  uint64_t payload[3];
+};
+
+struct tree_node {
+  struct tree_node *left, *right;
+  uint64_t key;
+};
+
+static void list_body(struct worker *w) {
+  for (int r = 0; r < 4 * scale; r++) {
+    struct list_node *head = NULL;
+    for (int i = 0; i < LIST_NODES; i++) {
+      struct list_node *n = b_alloc(w, sizeof(struct list_node));
+      n->next = head;
+      n->payload[0] = i;
+      head = n;
+    }
+    for (struct list_node *next; head; head = next) {
+      next = head->next;
+      b_free(w, head);
+    }
+  }
+}
+
+static void tree_free(struct worker *w, struct tree_node *t) {
+  if (t == NULL)
+    return;
+  tree_free(w, t->left);
+  tree_free(w, t->right);
+  b_free(w, t);
+}
+
+static void tree_body(struct worker *w) {
+  for (int r = 0; r < 4 * scale; r++) {
+    struct tree_node *root = NULL;
+    for (int i = 0; i < TREE_NODES; i++) {
+      struct tree_node *n = b_alloc(w, sizeof(struct tree_node));
+      *n = (struct tree_node) { .key = xorshift(&w->seed) };
+      struct tree_node **pp = &root;
+      while (*pp != NULL)
+        pp = n->key < (*pp)->key ? &(*pp)->left : &(*pp)->right;
+      *pp = n;
+    }
+    tree_free(w, root);
+  }
+}
+
+// ============== driver ===============
+
+struct workload {
+  const char *name;
+  void (*setup)();
+  void (*body)(struct worker *w);
+};
+
+static struct workload workloads[] = {
+  { "larson",        NULL,               larson_body },
+  { "threadtest",    NULL,               threadtest_body },
+  { "xmalloc",       NULL,               xmalloc_body },
+  { "cache-scratch", cache_scratch_setup, cache_scratch_body },
+  { "cache-thrash",  NULL,               cache_thrash_body },
+  { "list",          NULL,               list_body },
+  { "tree",          NULL,               tree_body },
+};
+
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static struct workload *wl;
+
+static void *worker_entry(void *arg) {
+  struct worker *w = arg;
+  pthread_barrier_wait(&barrier);
+  clock_gettime(CLOCK_MONOTONIC, &w->start);
+  wl->body(w);
+  clock_gettime(CLOCK_MONOTONIC, &w->end);
+  return NULL;
+}
+
+static double ts_sec(struct timespec t) {
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static struct counter cache_counters[] = {
+  { "l1d_miss", PERF_TYPE_HW_CACHE,
+    HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  { "llc_ref",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+  { "llc_miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+#define NR_COUNTERS (sizeof(cache_counters) / sizeof(cache_counters[0]))
+
+struct result {
+  uint64_t ops;
+  double seconds;
+  uint64_t events[NR_COUNTERS];
+};
+
+static struct result run_workload() {
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  for (int i = 0; i < MAX_THREADS / 2 + 1; i++)
+    spin_init(&xrings[i].lk);
+  be->init();
+  if (wl->setup)
+    wl->setup();
+  if (use_counters) {
+    counters_open(cache_counters, NR_COUNTERS);
+    counters_enable(cache_counters, NR_COUNTERS);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    workers[i] = (struct worker) { .idx = i, .seed = 0x9e3779b97f4a7c15ull * (i + 1) };
+    pthread_create(&workers[i].thread, NULL, worker_entry, &workers[i]);
+  }
+  struct result res = { 0, 0 };
+  double start = 0, end = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    res.ops += workers[i].ops;
+    if (i == 0 || ts_sec(workers[i].start) < start)
+      start = ts_sec(workers[i].start);
+    if (ts_sec(workers[i].end) > end)
+      end = ts_sec(workers[i].end);
+  }
+  res.seconds = end - start;
+  if (use_counters) {
+    counters_disable(cache_counters, NR_COUNTERS);
+    counters_read(cache_counters, NR_COUNTERS, res.events);
+    counters_close(cache_counters, NR_COUNTERS);
+  }
+  return res;
+}
+
+static void run_one(struct workload *w, struct backend *b) {
+  int fd[2];
+  if (pipe(fd) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // keep the table clean: the allocator may print while initializing
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    close(fd[0]);
+    wl = w;
+    be = b;
+    struct result res = run_workload();
+#ifdef LOCK_STAT
+    fprintf(stderr, "# %s %s\n", w->name, b->name);
+    lock_stat_dump(stderr);
+#endif
+    if (write(fd[1], &res, sizeof(res)) != sizeof(res))
+      _exit(1);
+    _exit(0);
+  }
+  close(fd[1]);
+  struct result res;
+  ssize_t n = read(fd[0], &res, sizeof(res));
+  close(fd[0]);
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  if (n != sizeof(res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%s\t%s\t%d\tFAILED\n", w->name, b->name, nthreads);
+    return;
+  }
+  printf("%s\t%s\t%d\t%lu\t%.6f\t%.0f\t%ld", w->name, b->name, nthreads,
+         res.ops, res.seconds, res.ops / res.seconds, ru.ru_maxrss);
+  for (int i = 0; use_counters && i < NR_COUNTERS; i++) {
+    if (res.events[i] == COUNTER_NA)
+      printf("\t-");
+    else
+      printf("\t%.3f", (double)res.events[i] / res.ops);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct backend *sel_be[NR_BACKENDS];
+  int nr_be = 0, header = 1, opt;
+  nthreads = CPU_NUM;
+  while ((opt = getopt(argc, argv, "b:t:s:np")) != -1) {
+    switch (opt) {
+    case 'b':
+      for (int i = 0; i < NR_BACKENDS; i++)
+        if (strcmp(optarg, backends[i].name) == 0)
+          sel_be[nr_be++] = &backends[i];
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 's':
+      scale = atoi(optarg);
+      break;
+    case 'n':
+      header = 0;
+      break;
+    case 'p':
+      use_counters = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b backend]... [-t threads] [-s scale] [-n] [-p] [workload]...\n", argv[0]);
+      exit(1);
+    }
+  }
+  assert(nthreads >= 1 && nthreads <= MAX_THREADS && scale >= 1);
+  if (nr_be == 0)
+    for (int i = 0; i < NR_BACKENDS; i++)
+      sel_be[nr_be++] = &backends[i];
+
+  if (header) {
+    printf("workload\tbackend\tthreads\tops\tseconds\tops_per_sec\tpeak_rss_kb");
+    for (int i = 0; use_counters && i < NR_COUNTERS; i++)
+      printf("\t%s_per_op", cache_counters[i].name);
+    printf("\n");
+  }
+  for (int i = 0; i < NR_WORKLOADS; i++) {
+    int selected = optind == argc;
+    for (int j = optind; j < argc; j++)
+      selected |= strcmp(argv[j], workloads[i].name) == 0;
+    if (!selected)
+      continue;
+    for (int j = 0; j < nr_be; j++)
+      run_one(&workloads[i], sel_be[j]);
+  }
+  return 0;
+}
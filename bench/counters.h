@@ -0,0 +1,78 @@
+/*
+    hardware event counters over perf_event_open(2)
+
+    counters are opened disabled on the calling thread with inherit set, so
+    threads created after counters_enable() are counted as well. a counter
+    the kernel or the hypervisor does not provide stays closed (fd == -1) and
+    reads back as COUNTER_NA; callers print those as "-".
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define COUNTER_NA UINT64_MAX
+
+#define HW_CACHE_EVENT(cache, op, result) \
+  ((cache) | ((op) << 8) | ((result) << 16))
+
+struct counter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+};
+
+static int counters_open(struct counter *c, int n) {
+  int opened = 0;
+  for (int i = 0; i < n; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = c[i].type;
+    attr.config = c[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    c[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    opened += c[i].fd >= 0;
+  }
+  return opened;
+}
+
+static void counters_enable(struct counter *c, int n) {
+  for (int i = 0; i < n; i++)
+    if (c[i].fd >= 0)
+      ioctl(c[i].fd, PERF_EVENT_IOC_RESET, 0);
+  for (int i = 0; i < n; i++)
+    if (c[i].fd >= 0)
+      ioctl(c[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void counters_disable(struct counter *c, int n) {
+  for (int i = 0; i < n; i++)
+    if (c[i].fd >= 0)
+      ioctl(c[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+// values are scaled up when the PMU had to multiplex the counters
+static void counters_read(struct counter *c, int n, uint64_t *val) {
+  for (int i = 0; i < n; i++) {
+    uint64_t buf[3];
+    val[i] = COUNTER_NA;
+    if (c[i].fd < 0 || read(c[i].fd, buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+      continue;
+    val[i] = buf[1] == buf[2] ? buf[0] : (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+  }
+}
+
+static void counters_close(struct counter *c, int n) {
+  for (int i = 0; i < n; i++)
+    if (c[i].fd >= 0)
+      close(c[i].fd);
+}
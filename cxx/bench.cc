@@ -0,0 +1,245 @@
+/*
+    container churn benchmark
+
+      build/bench-cxx [-b backend]... [-t threads] [-s scale] [-n] [workload]...
+
+      -b: std | kma | pmr-kma | pmr-arena (default: all)
+      -t: worker threads (default: 4)
+      -s: iteration scale (default: 1)
+      -n: do not print the table header
+
+    every worker fills and empties its own std::map, std::list and
+    std::unordered_map over and over, so the node allocations and frees
+    dominate. backends:
+
+      std        the default allocator (glibc malloc)
+      kma        kma::allocator<T>
+      pmr-kma    std::pmr containers on kma::default_resource()
+      pmr-arena  std::pmr containers on kma::thread_arena(), released after
+                 every round
+
+    as in bench/bench.c every (workload, backend) pair runs in a forked
+    child and prints one row:
+
+      workload  backend  threads  ops  seconds  ops_per_sec  peak_rss_kb
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "kma.hpp"
+
+#define MAX_THREADS 64
+#define ROUNDS 64
+#define KEYS 4096
+
+static int nthreads = 4;
+static int scale = 1;
+
+static inline uint64_t xorshift(uint64_t &s) {
+  s ^= s << 13;
+  s ^= s >> 7;
+  s ^= s << 17;
+  return s;
+}
+
+// ============== workloads ===============
+// each takes an allocator (or polymorphic_allocator) of char and rebinds it
+
+template <template <class> class A>
+static uint64_t map_churn(A<char> a, uint64_t &seed) {
+  using V = std::pair<const uint64_t, uint64_t>;
+  std::map<uint64_t, uint64_t, std::less<uint64_t>, A<V>> m{A<V>(a)};
+  uint64_t ops = 0;
+  for (int i = 0; i < KEYS; i++, ops++)
+    m.emplace(xorshift(seed) % (2 * KEYS), i);
+  for (int i = 0; i < 4 * KEYS; i++, ops += 2) {
+    m.erase(xorshift(seed) % (2 * KEYS));
+    m.emplace(xorshift(seed) % (2 * KEYS), i);
+  }
+  return ops + m.size();
+}
+
+template <template <class> class A>
+static uint64_t list_churn(A<char> a, uint64_t &seed) {
+  std::list<uint64_t, A<uint64_t>> l{A<uint64_t>(a)};
+  uint64_t ops = 0;
+  for (int i = 0; i < KEYS; i++, ops++)
+    l.push_back(i);
+  for (int i = 0; i < 4 * KEYS; i++, ops += 2) {
+    l.pop_front();
+    if (xorshift(seed) & 1)
+      l.push_back(i);
+    else
+      l.push_front(i);
+  }
+  return ops + l.size();
+}
+
+template <template <class> class A>
+static uint64_t unordered_map_churn(A<char> a, uint64_t &seed) {
+  using V = std::pair<const uint64_t, uint64_t>;
+  std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, A<V>> m{A<V>(a)};
+  uint64_t ops = 0;
+  for (int i = 0; i < KEYS; i++, ops++)
+    m.emplace(xorshift(seed) % (2 * KEYS), i);
+  for (int i = 0; i < 4 * KEYS; i++, ops += 2) {
+    m.erase(xorshift(seed) % (2 * KEYS));
+    m.emplace(xorshift(seed) % (2 * KEYS), i);
+  }
+  return ops + m.size();
+}
+
+struct workload {
+  const char *name;
+  uint64_t (*std)(std::allocator<char>, uint64_t &);
+  uint64_t (*kma)(kma::allocator<char>, uint64_t &);
+  uint64_t (*pmr)(std::pmr::polymorphic_allocator<char>, uint64_t &);
+};
+
+static workload workloads[] = {
+  { "map",           map_churn<std::allocator>,           map_churn<kma::allocator>,
+                     map_churn<std::pmr::polymorphic_allocator> },
+  { "list",          list_churn<std::allocator>,          list_churn<kma::allocator>,
+                     list_churn<std::pmr::polymorphic_allocator> },
+  { "unordered_map", unordered_map_churn<std::allocator>, unordered_map_churn<kma::allocator>,
+                     unordered_map_churn<std::pmr::polymorphic_allocator> },
+};
+
+// ============== backends ===============
+
+enum { BE_STD, BE_KMA, BE_PMR_KMA, BE_PMR_ARENA, NR_BACKENDS };
+static const char *backend_name[NR_BACKENDS] = { "std", "kma", "pmr-kma", "pmr-arena" };
+
+// one round of w on backend be, the containers gone when it returns
+static uint64_t round_of(const workload &w, int be, uint64_t &seed) {
+  switch (be) {
+  case BE_STD:
+    return w.std(std::allocator<char>(), seed);
+  case BE_KMA:
+    return w.kma(kma::allocator<char>(), seed);
+  case BE_PMR_KMA:
+    return w.pmr(kma::default_resource(), seed);
+  default: {
+    uint64_t ops = w.pmr(&kma::thread_arena(), seed);
+    kma::thread_arena().release();
+    return ops;
+  }
+  }
+}
+
+// ============== harness ===============
+
+struct result {
+  uint64_t ops;
+  double seconds;
+};
+
+static result run_workload(const workload &w, int be) {
+  if (be != BE_STD)
+    pmm_init();
+  std::vector<std::thread> workers;
+  std::vector<uint64_t> ops(nthreads);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < nthreads; i++)
+    workers.emplace_back([&, i] {
+      uint64_t seed = 0x9e3779b97f4a7c15ull * (i + 1);
+      for (int r = 0; r < ROUNDS * scale; r++)
+        ops[i] += round_of(w, be, seed);
+    });
+  for (auto &t : workers)
+    t.join();
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  result res = { 0, d.count() };
+  for (uint64_t n : ops)
+    res.ops += n;
+  return res;
+}
+
+static void run_one(const workload &w, int be) {
+  int fd[2];
+  if (pipe(fd) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // keep the table clean: pmm_init() prints the heap it got
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    close(fd[0]);
+    result res = run_workload(w, be);
+    if (write(fd[1], &res, sizeof(res)) != sizeof(res))
+      _exit(1);
+    _exit(0);
+  }
+  close(fd[1]);
+  result res;
+  ssize_t n = read(fd[0], &res, sizeof(res));
+  close(fd[0]);
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  if (n != sizeof(res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%s\t%s\t%d\tFAILED\n", w.name, backend_name[be], nthreads);
+    return;
+  }
+  printf("%s\t%s\t%d\t%lu\t%.6f\t%.0f\t%ld\n", w.name, backend_name[be], nthreads,
+         res.ops, res.seconds, res.ops / res.seconds, ru.ru_maxrss);
+}
+
+int main(int argc, char *argv[]) {
+  int sel_be[NR_BACKENDS];
+  int nr_be = 0, header = 1, opt;
+  while ((opt = getopt(argc, argv, "b:t:s:n")) != -1) {
+    switch (opt) {
+    case 'b':
+      for (int i = 0; i < NR_BACKENDS; i++)
+        if (strcmp(optarg, backend_name[i]) == 0 && nr_be < NR_BACKENDS)
+          sel_be[nr_be++] = i;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 's':
+      scale = atoi(optarg);
+      break;
+    case 'n':
+      header = 0;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b backend]... [-t threads] [-s scale] [-n] [workload]...\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (nthreads < 1 || nthreads > MAX_THREADS || scale < 1) {
+    fprintf(stderr, "%s: threads must be in [1, %d], scale at least 1\n", argv[0], MAX_THREADS);
+    exit(1);
+  }
+  if (nr_be == 0)
+    for (int i = 0; i < NR_BACKENDS; i++)
+      sel_be[nr_be++] = i;
+
+  if (header)
+    printf("workload\tbackend\tthreads\tops\tseconds\tops_per_sec\tpeak_rss_kb\n");
+  for (const workload &w : workloads) {
+    int selected = optind == argc;
+    for (int j = optind; j < argc; j++)
+      selected |= strcmp(argv[j], w.name) == 0;
+    if (!selected)
+      continue;
+    for (int j = 0; j < nr_be; j++)
+      run_one(w, sel_be[j]);
+  }
+  return 0;
+}
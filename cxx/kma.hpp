@@ -0,0 +1,129 @@
+/*
+    C++ adapters over kalloc/kfree, header only
+
+      kma::resource        std::pmr::memory_resource; deallocate forwards
+                           the size to kfree_sized()
+      kma::allocator<T>    stateless, for std containers without pmr
+      kma::thread_arena()  a per-thread std::pmr::monotonic_buffer_resource
+                           whose buffers come from kma::default_resource()
+
+    there is no tid in the standard interfaces: every call goes to the heap
+    of the CPU the thread runs on (cpu_current()), as kalloc_cur does. a
+    block may be freed from any CPU. pmm_init() (or pmm_open()) has to run
+    before the first allocation.
+
+    pmm.h is C with GNU extensions all the way down, so the handful of entry
+    points used here are declared below instead of including it.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+void pmm_init();
+void *kalloc(int tid, size_t size);
+void kfree(int tid, void *ptr);
+void kfree_sized(int tid, void *ptr, size_t size);
+int cpu_current();
+}
+
+namespace kma {
+
+// ALIGN_SIZE in pmm.h: every kalloc block is aligned to it
+constexpr std::size_t align_size = 16;
+// first buffer of a thread_arena(): above MID_MAX, so that arena buffers
+// take the large block path
+constexpr std::size_t arena_initial = 64 * 1024;
+
+namespace detail {
+
+// an over-aligned block lives inside a bigger one, with the pointer kalloc
+// returned stored right in front of it
+inline void *allocate(std::size_t bytes, std::size_t align) {
+  if (align <= align_size) {
+    void *p = kalloc(cpu_current(), bytes);
+    if (p == nullptr)
+      throw std::bad_alloc();
+    return p;
+  }
+  void *p = kalloc(cpu_current(), bytes + align);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  // p is align_size aligned and align bigger: up is at least align_size past p
+  std::uintptr_t up = (reinterpret_cast<std::uintptr_t>(p) + align) & ~(align - 1);
+  reinterpret_cast<void **>(up)[-1] = p;
+  return reinterpret_cast<void *>(up);
+}
+
+inline void deallocate(void *p, std::size_t bytes, std::size_t align) noexcept {
+  if (align <= align_size)
+    kfree_sized(cpu_current(), p, bytes);
+  else
+    kfree_sized(cpu_current(), static_cast<void **>(p)[-1], bytes + align);
+}
+
+} // namespace detail
+
+class resource : public std::pmr::memory_resource {
+  void *do_allocate(std::size_t bytes, std::size_t align) override {
+    return detail::allocate(bytes, align);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+    detail::deallocate(p, bytes, align);
+  }
+
+  // any two share the one heap
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return dynamic_cast<const resource *>(&other) != nullptr;
+  }
+};
+
+inline resource *default_resource() noexcept {
+  static resource r;
+  return &r;
+}
+
+template <class T>
+struct allocator {
+  using value_type = T;
+
+  allocator() noexcept = default;
+  template <class U>
+  allocator(const allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+      throw std::bad_array_new_length();
+    return static_cast<T *>(detail::allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept {
+    detail::deallocate(p, n * sizeof(T), alignof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+  return false;
+}
+
+// allocation is a pointer bump and deallocate does nothing; release() hands
+// every buffer back at once. for containers that live and die together
+// within one thread.
+inline std::pmr::monotonic_buffer_resource &thread_arena() {
+  thread_local std::pmr::monotonic_buffer_resource arena(arena_initial, default_resource());
+  return arena;
+}
+
+} // namespace kma
@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "pmm.h"
+
+/*
+    epoch based deferred free (quiescent state based reclamation)
+
+    kfree_deferred() strings retired blocks together through their
+    alloc_header (see retired_header): retiring never allocates and never
+    writes to the payload that readers may still be looking at. every
+    DEFER_BATCH blocks the batch is sealed with a fresh epoch
+    E = ++global_epoch, and it may be freed once every online tid has
+    announced an epoch >= E, i.e. passed a quiescent state after the blocks
+    were unlinked.
+
+    a ready batch is sorted by owning chain and handed back chain by chain,
+    so a chain lock (or a BIGMEM shard lock) is taken once per batch and
+    chain instead of once per block. small blocks need no lock and go
+    straight back to their slot page, whichever chain it hangs off by now.
+*/
+
+#define DEFER_BATCH 64
+#define DEFER_PENDING 4
+
+// what a retired block's alloc_header turns into: all but magic survives,
+// which carries the link to the next retired block as an offset from
+// shard_base (the heap fits 32 bits, see pmm_init_heap). 0 ends a list.
+// deferred frees are for kmem_default only.
+typedef struct {
+  int cpu_id;
+  uint32_t len;
+  uint32_t next;
+  uint16_t sampled;
+  uint16_t slot;
+} __attribute__((aligned(ALIGN_SIZE))) retired_header;
+
+_Static_assert(sizeof(retired_header) == sizeof(alloc_header), "retired_header must overlay alloc_header");
+_Static_assert(offsetof(retired_header, slot) == offsetof(alloc_header, slot), "slot must survive retiring");
+
+struct defer_batch {
+  void *head, *tail;
+  int n;
+  uint64_t epoch;
+};
+
+typedef struct {
+  spinlock_t lk;
+  struct defer_batch cur;                    // being filled
+  struct defer_batch pending[DEFER_PENDING]; // sealed, oldest first
+  int nr_pending;
+  // written by the owner on every announcement, read by every reclaimer
+  uint64_t quiescent __attribute__((aligned(CACHELINE_SIZE))); // 0: offline
+} __attribute__((aligned(CACHELINE_SIZE))) defer_cpu_t;
+
+static uint64_t global_epoch = 1;
+static defer_cpu_t defer_cpu[MAX_CPU] = {
+  [0 ... MAX_CPU - 1] = { .lk = SPINLOCK_INIT(LK_DEFER) },
+};
+
+static inline retired_header *retired_of(void *ptr) {
+  return (retired_header *)((uintptr_t)ptr - sizeof(retired_header));
+}
+
+static inline uint32_t retired_link(void *ptr) {
+  return ptr != NULL ? (uintptr_t)ptr - kmem_default.shard_base : 0;
+}
+
+static inline void *retired_next(retired_header *rh) {
+  return rh->next != 0 ? (void *)(kmem_default.shard_base + rh->next) : NULL;
+}
+
+// batches sealed at or before this epoch are unreachable for every reader
+static uint64_t safe_epoch() {
+  uint64_t min = UINT64_MAX;
+  for (int i = 0; i < CPU_NUM; i++) {
+    uint64_t q = __atomic_load_n(&defer_cpu[i].quiescent, __ATOMIC_ACQUIRE);
+    if (q != 0 && q < min)
+      min = q;
+  }
+  return min;
+}
+
+struct retired {
+  page_t *chain;         // NULL: BIGMEM
+  freenode_head_t *shard; // BIGMEM only
+  void *ptr;
+};
+
+static int by_chain(const void *a, const void *b) {
+  const struct retired *ra = a, *rb = b;
+  if (ra->chain != rb->chain)
+    return (uintptr_t)ra->chain < (uintptr_t)rb->chain ? -1 : 1;
+  if (ra->shard != rb->shard)
+    return (uintptr_t)ra->shard < (uintptr_t)rb->shard ? -1 : 1;
+  return (uintptr_t)ra->ptr < (uintptr_t)rb->ptr ? -1 : (ra->ptr != rb->ptr);
+}
+
+static void free_batch(void *head) {
+  struct retired blk[DEFER_BATCH];
+  while (head != NULL) {
+    int n = 0;
+    while (head != NULL && n < DEFER_BATCH) {
+      retired_header *rh = retired_of(head);
+      void *ptr = head;
+      head = retired_next(rh);
+      ((alloc_header *)rh)->magic = 0x6d616c63;
+      if (rh->slot != 0) {
+        slot_free(&kmem_default, ptr);
+        continue;
+      }
+      // takes the locks of every shard it runs over
+      if (rh->cpu_id == -1 && BIGMEM_spans(&kmem_default, ptr)) {
+        BIGMEM_coalescing_free(&kmem_default, ptr);
+        continue;
+      }
+      blk[n++] = (struct retired) {
+        .chain = rh->cpu_id == -1 ? NULL : chain_of(&kmem_default, rh->cpu_id, rh->len),
+        .shard = rh->cpu_id == -1 ? shard_of(&kmem_default, ptr) : NULL,
+        .ptr = ptr,
+      };
+    }
+    qsort(blk, n, sizeof(blk[0]), by_chain);
+    for (int i = 0; i < n; ) {
+      page_t *chain = blk[i].chain;
+      freenode_head_t *sh = blk[i].shard;
+      spinlock_t *lk = chain ? &(chain->HDR.lock) : &(sh->lk);
+      spin_lock(lk);
+      for (; i < n && blk[i].chain == chain && blk[i].shard == sh; i++) {
+        if (chain)
+          chain_free(&kmem_default, chain, blk[i].ptr);
+        else
+          BIGMEM_free_locked(sh, blk[i].ptr);
+      }
+      spin_unlock(lk);
+    }
+  }
+}
+
+// caller holds dc->lk. with every pending slot taken, cur joins the newest
+// pending batch, which then has to wait for the new epoch as well.
+static void seal(defer_cpu_t *dc) {
+  if (dc->cur.n == 0)
+    return;
+  uint64_t epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+  if (dc->nr_pending == DEFER_PENDING) {
+    struct defer_batch *last = &dc->pending[DEFER_PENDING - 1];
+    retired_of(last->tail)->next = retired_link(dc->cur.head);
+    last->tail = dc->cur.tail;
+    last->n += dc->cur.n;
+    last->epoch = epoch;
+  }
+  else {
+    dc->cur.epoch = epoch;
+    dc->pending[dc->nr_pending++] = dc->cur;
+  }
+  dc->cur = (struct defer_batch) { .head = NULL, .tail = NULL, .n = 0 };
+}
+
+static void reclaim(defer_cpu_t *dc) {
+  uint64_t safe = safe_epoch();
+  void *ready[DEFER_PENDING];
+  int n = 0;
+  spin_lock(&(dc->lk));
+  while (n < dc->nr_pending && dc->pending[n].epoch <= safe) {
+    ready[n] = dc->pending[n].head;
+    n++;
+  }
+  dc->nr_pending -= n;
+  memmove(dc->pending, dc->pending + n, dc->nr_pending * sizeof(dc->pending[0]));
+  spin_unlock(&(dc->lk));
+  for (int i = 0; i < n; i++)
+    free_batch(ready[i]);
+}
+
+void kfree_deferred(int tid, void *ptr) {
+  defer_cpu_t *dc = &defer_cpu[tid];
+  retired_header *rh = retired_of(ptr);
+  assert(((alloc_header *)rh)->magic == 0x6d616c63);
+  KTRACE_EMIT(KT_FREE_DEFERRED, tid, ptr, ((alloc_header *)rh)->len);
+#ifdef HEAP_PROFILE
+  // the link to the next retired block is about to cover the mark
+  if (((alloc_header *)rh)->sampled)
+    prof_forget(ptr);
+#endif
+  spin_lock(&(dc->lk));
+  rh->next = 0;
+  if (dc->cur.n == 0)
+    dc->cur.head = ptr;
+  else
+    retired_of(dc->cur.tail)->next = retired_link(ptr);
+  dc->cur.tail = ptr;
+  int full = ++dc->cur.n >= DEFER_BATCH;
+  if (full)
+    seal(dc);
+  spin_unlock(&(dc->lk));
+  if (full)
+    reclaim(dc);
+}
+
+static void announce(int tid, uint64_t epoch) {
+  __atomic_store_n(&defer_cpu[tid].quiescent, epoch, __ATOMIC_RELEASE);
+}
+
+void kepoch_online(int tid) {
+  announce(tid, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST));
+}
+
+// tid holds no reference to a shared block from here on. also reclaims
+// tid's own ready batches; a partial batch is sealed early only when nothing
+// else is pending, so a tid retiring few blocks still gets them back.
+void kepoch_quiescent(int tid) {
+  defer_cpu_t *dc = &defer_cpu[tid];
+  announce(tid, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST));
+  spin_lock(&(dc->lk));
+  if (dc->nr_pending == 0)
+    seal(dc);
+  int pending = dc->nr_pending;
+  spin_unlock(&(dc->lk));
+  if (pending)
+    reclaim(dc);
+}
+
+// seals the partial batch of a tid with nothing pending, as
+// kepoch_quiescent() would, and frees what is ready
+void kepoch_reclaim_all() {
+  for (int i = 0; i < CPU_NUM; i++) {
+    defer_cpu_t *dc = &defer_cpu[i];
+    spin_lock(&(dc->lk));
+    if (dc->nr_pending == 0)
+      seal(dc);
+    spin_unlock(&(dc->lk));
+    reclaim(dc);
+  }
+}
+
+// the batches of a tid that stays offline are only reclaimed here, so going
+// offline sweeps every tid's pending batches.
+void kepoch_offline(int tid) {
+  defer_cpu_t *dc = &defer_cpu[tid];
+  spin_lock(&(dc->lk));
+  seal(dc);
+  spin_unlock(&(dc->lk));
+  announce(tid, 0);
+  for (int i = 0; i < CPU_NUM; i++)
+    reclaim(&defer_cpu[i]);
+}
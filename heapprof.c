@@ -0,0 +1,225 @@
+#ifdef HEAP_PROFILE
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include "pmm.h"
+
+/*
+    sampling heap profiler, built with -DHEAP_PROFILE (link with -lm)
+
+    every thread charges the bytes it allocates to prof_bytes_left; the
+    allocation that drives it below zero is sampled and the counter is reset
+    to an exponentially distributed interval with mean prof_rate, so each
+    byte is equally likely to be picked and unsampled calls cost one
+    subtraction. a sampled block gets alloc_header.sampled set, its stack in
+    the bucket table and its size in the live table keyed by pointer; kfree
+    looks the pointer up only for marked blocks.
+
+    kprof_dump() writes the legacy gperftools text format ("heap_v2"), which
+    pprof reads as is and unsamples itself:
+
+      heap profile: <live objs>: <live bytes> [<allocs>: <alloc bytes>] @ heap_v2/<rate>
+      <live objs>: <live bytes> [<allocs>: <alloc bytes>] @ <pc> <pc> ...
+      ...
+      MAPPED_LIBRARIES:
+      <the contents of /proc/self/maps>
+*/
+
+#define PROF_DEPTH 32
+#define PROF_BUCKETS (1 << 12) // distinct stacks
+#define PROF_LIVE (1 << 14)    // live samples
+#define PROF_SKIP 8            // frames in kma_prof_text at most
+
+// bounds of the PROF_TEXT functions, from the linker
+extern char __start_kma_prof_text[], __stop_kma_prof_text[];
+
+static inline int prof_text(void *pc) {
+  return (char *)pc >= __start_kma_prof_text && (char *)pc < __stop_kma_prof_text;
+}
+
+struct prof_bucket {
+  int depth;
+  void *pc[PROF_DEPTH];
+  uint64_t hash;
+  uint64_t live_objs, live_bytes;
+  uint64_t alloc_objs, alloc_bytes;
+};
+
+struct prof_live {
+  void *ptr; // NULL: empty, PROF_GONE: deleted
+  size_t size;
+  struct prof_bucket *bucket;
+};
+
+#define PROF_GONE ((void *)1)
+
+__thread long prof_bytes_left;
+static __thread int prof_armed;
+static __thread int prof_busy;
+static __thread uint64_t prof_seed;
+
+static size_t prof_rate = 512 * 1024;
+static spinlock_t prof_lk = (spinlock_t) {.locked = 0};
+static struct prof_bucket buckets[PROF_BUCKETS];
+static struct prof_live live[PROF_LIVE];
+
+void kprof_set_rate(size_t bytes) {
+  __atomic_store_n(&prof_rate, bytes, __ATOMIC_RELAXED);
+}
+
+static uint64_t prof_random() {
+  if (prof_seed == 0)
+    prof_seed = ((uintptr_t)&prof_seed ^ ((uint64_t)time(NULL) << 20)) | 1;
+  prof_seed ^= prof_seed << 13;
+  prof_seed ^= prof_seed >> 7;
+  prof_seed ^= prof_seed << 17;
+  return prof_seed;
+}
+
+// bytes up to the next sample: exponential, i.e. the gap between the
+// points of a Poisson process over the allocated bytes
+static long prof_interval() {
+  double u = ((prof_random() >> 11) + 1) * (1.0 / (UINT64_C(1) << 53));
+  return (long)(-log(u) * __atomic_load_n(&prof_rate, __ATOMIC_RELAXED)) + 1;
+}
+
+static inline uint64_t hash_ptr(const void *p) {
+  return ((uintptr_t)p >> 4) * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+// caller holds prof_lk
+static struct prof_bucket *bucket_of(void **pc, int depth) {
+  uint64_t h = 14695981039346656037u;
+  for (int i = 0; i < depth; i++)
+    h = (h ^ (uintptr_t)pc[i]) * 1099511628211u;
+  for (int i = 0; i < PROF_BUCKETS; i++) {
+    struct prof_bucket *b = &buckets[(h + i) % PROF_BUCKETS];
+    if (b->depth == 0) {
+      b->depth = depth;
+      b->hash = h;
+      memcpy(b->pc, pc, depth * sizeof(pc[0]));
+      return b;
+    }
+    if (b->hash == h && b->depth == depth && memcmp(b->pc, pc, depth * sizeof(pc[0])) == 0)
+      return b;
+  }
+  return NULL;
+}
+
+// caller holds prof_lk. a probe sequence ends at an empty slot only, deleted
+// ones are stepped over by lookups and reused by inserts.
+static struct prof_live *live_find(void *ptr) {
+  uint64_t h = hash_ptr(ptr);
+  for (int i = 0; i < PROF_LIVE; i++) {
+    struct prof_live *l = &live[(h + i) % PROF_LIVE];
+    if (l->ptr == ptr)
+      return l;
+    if (l->ptr == NULL)
+      break;
+  }
+  return NULL;
+}
+
+static struct prof_live *live_insert(void *ptr) {
+  uint64_t h = hash_ptr(ptr);
+  for (int i = 0; i < PROF_LIVE; i++) {
+    struct prof_live *l = &live[(h + i) % PROF_LIVE];
+    if (l->ptr == NULL || l->ptr == PROF_GONE)
+      return l;
+  }
+  return NULL;
+}
+
+PROF_TEXT void prof_sample(void *ptr, size_t size) {
+  // backtrace() may allocate the first time it runs
+  if (prof_busy)
+    return;
+  prof_busy = 1;
+  prof_bytes_left = prof_interval();
+  if (!prof_armed) {
+    // the first call only draws the first interval
+    prof_armed = 1;
+    prof_busy = 0;
+    return;
+  }
+  void *pc[PROF_DEPTH + PROF_SKIP];
+  int n = backtrace(pc, PROF_DEPTH + PROF_SKIP), skip = 0;
+  while (skip < n && prof_text(pc[skip]))
+    skip++;
+  int depth = n - skip < PROF_DEPTH ? n - skip : PROF_DEPTH;
+  if (depth <= 0) {
+    prof_busy = 0;
+    return;
+  }
+  spin_lock(&prof_lk);
+  struct prof_bucket *b = bucket_of(pc + skip, depth);
+  struct prof_live *l = b ? live_insert(ptr) : NULL;
+  if (l != NULL) {
+    *l = (struct prof_live) {.ptr = ptr, .size = size, .bucket = b};
+    b->live_objs++;
+    b->live_bytes += size;
+    b->alloc_objs++;
+    b->alloc_bytes += size;
+    ((alloc_header *)((uintptr_t)ptr - sizeof(alloc_header)))->sampled = 1;
+  }
+  spin_unlock(&prof_lk);
+  prof_busy = 0;
+}
+
+void prof_forget(void *ptr) {
+  ((alloc_header *)((uintptr_t)ptr - sizeof(alloc_header)))->sampled = 0;
+  spin_lock(&prof_lk);
+  struct prof_live *l = live_find(ptr);
+  if (l != NULL) {
+    l->bucket->live_objs--;
+    l->bucket->live_bytes -= l->size;
+    l->ptr = PROF_GONE;
+  }
+  spin_unlock(&prof_lk);
+}
+
+static void copy_maps(int fd) {
+  char buf[4096];
+  ssize_t n;
+  int in = open("/proc/self/maps", O_RDONLY);
+  if (in < 0)
+    return;
+  while ((n = read(in, buf, sizeof(buf))) > 0)
+    if (write(fd, buf, n) != n)
+      break;
+  close(in);
+}
+
+// live and cumulative profile of the sampled allocations; 0 on success
+int kprof_dump(int fd) {
+  uint64_t live_objs = 0, live_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+  spin_lock(&prof_lk);
+  for (int i = 0; i < PROF_BUCKETS; i++) {
+    live_objs += buckets[i].live_objs;
+    live_bytes += buckets[i].live_bytes;
+    alloc_objs += buckets[i].alloc_objs;
+    alloc_bytes += buckets[i].alloc_bytes;
+  }
+  int err = dprintf(fd, "heap profile: %6lu: %8lu [%6lu: %8lu] @ heap_v2/%zu\n",
+                    live_objs, live_bytes, alloc_objs, alloc_bytes, prof_rate) < 0;
+  for (int i = 0; i < PROF_BUCKETS && !err; i++) {
+    struct prof_bucket *b = &buckets[i];
+    if (b->depth == 0)
+      continue;
+    err |= dprintf(fd, "%6lu: %8lu [%6lu: %8lu] @", b->live_objs, b->live_bytes,
+                   b->alloc_objs, b->alloc_bytes) < 0;
+    for (int j = 0; j < b->depth; j++)
+      err |= dprintf(fd, " %p", b->pc[j]) < 0;
+    err |= dprintf(fd, "\n") < 0;
+  }
+  spin_unlock(&prof_lk);
+  if (!err) {
+    err = dprintf(fd, "\nMAPPED_LIBRARIES:\n") < 0;
+    copy_maps(fd);
+  }
+  return err ? -1 : 0;
+}
+#endif
@@ -0,0 +1,39 @@
+#ifdef LOCK_STAT
+#include "pmm.h"
+
+// per CPU, per lock class counters, see spinlock.h
+lock_stat_cpu_t lock_stats[LOCK_STAT_CPUS];
+
+static const char *lock_class_name[NR_LOCK_CLASSES] = {
+  [LK_OTHER]  = "other",
+  [LK_CHAIN]  = "chain",
+  [LK_MID]    = "mid",
+  [LK_BIGMEM] = "bigmem",
+  [LK_DEFER]  = "defer",
+  [LK_ORPHAN] = "orphan",
+};
+
+// one row per class that was taken: counts summed over CPUs, cycles per
+// contended acquisition and per hold, and the longest hold on any CPU
+void lock_stat_dump(FILE *f) {
+  fprintf(f, "lock\tacquired\tcontended\tcontended_pct\tspin_cycles\tspin_per_contended\thold_per_acquired\tmax_hold\n");
+  for (int c = 0; c < NR_LOCK_CLASSES; c++) {
+    lock_stat_t sum = {0};
+    for (int i = 0; i < LOCK_STAT_CPUS; i++) {
+      lock_stat_t *st = &lock_stats[i].cls[c];
+      sum.acquired += st->acquired;
+      sum.contended += st->contended;
+      sum.spin_cycles += st->spin_cycles;
+      sum.hold_cycles += st->hold_cycles;
+      if (st->max_hold > sum.max_hold)
+        sum.max_hold = st->max_hold;
+    }
+    if (sum.acquired == 0)
+      continue;
+    fprintf(f, "%s\t%lu\t%lu\t%.2f\t%lu\t%.0f\t%.0f\t%lu\n", lock_class_name[c],
+            sum.acquired, sum.contended, 100.0 * sum.contended / sum.acquired,
+            sum.spin_cycles, sum.contended ? (double)sum.spin_cycles / sum.contended : 0,
+            (double)sum.hold_cycles / sum.acquired, sum.max_hold);
+  }
+}
+#endif
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pmm.h"
+
+/*
+    file backed heap
+
+    pmm_open() maps a file MAP_SHARED at a fixed base and runs the allocator
+    on it. the first page(s) hold a superblock; everything behind it is the
+    heap, page chains and free_node lists included. since the mapping always
+    comes back at the same address every pointer stored in the heap stays
+    valid, and reopening only copies the superblock back into
+    the BIGMEM shards and chains of kmem_default: its cost does not depend on how
+    much of the heap is in use.
+
+    the superblock is written by pmm_sync() and pmm_close(). the file is
+    consistent after either returned and before the next kalloc/kfree
+    (pmm_sync() empties the large block caches for that);
+    blocks still sitting in kfree_deferred() batches at that point are lost.
+*/
+
+#ifndef PMM_FILE_BASE
+#define PMM_FILE_BASE 0x600000000000ul
+#endif
+
+#define PERSIST_MAGIC 0x6b6d612d68656170ul // kma-heap
+
+struct superblock {
+  uint64_t magic;
+  // layout of what follows, a file from another build is refused
+  uint32_t cpu_num;
+  uint32_t cpu_pages_size;
+  uint32_t page_size;
+  uintptr_t base;
+  size_t size;
+  void *root;
+  uintptr_t shard_base;
+  size_t shard_span;
+  int nr_shards;
+  free_node *mem_addr[MAX_SHARDS];
+  int mem_obj_cnt[MAX_SHARDS];
+  size_t kcache_bytes;
+  cpu_pages_t cpu[CPU_NUM];
+  page_t *orphan[FIRST_MID_CLASS];
+  uint32_t nr_orphan[FIRST_MID_CLASS];
+  page_t *full[FIRST_MID_CLASS];
+  uint32_t nr_full[FIRST_MID_CLASS];
+};
+
+#define SB_SIZE ROUNDUP(sizeof(struct superblock), PAGE_SIZE)
+
+static struct superblock *sb;
+
+static int sb_valid(struct superblock *s, size_t size) {
+  return s->magic == PERSIST_MAGIC && s->cpu_num == CPU_NUM &&
+         s->cpu_pages_size == sizeof(cpu_pages_t) && s->page_size == PAGE_SIZE &&
+         s->base == PMM_FILE_BASE && s->size == size &&
+         s->nr_shards >= 1 && s->nr_shards <= MAX_SHARDS;
+}
+
+// restores the allocator from a file written by pmm_sync()/pmm_close(), or
+// sets up a fresh heap of size bytes in a new file. returns 1 when restored,
+// 0 when created, -1 on error (the file is of another size or build, or
+// the base address is taken).
+int pmm_open(const char *path, size_t size) {
+  assert(sb == NULL && size > SB_SIZE + CACHELINE_SIZE);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  int fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+  if ((fresh && ftruncate(fd, size) != 0) || (!fresh && st.st_size != size)) {
+    close(fd);
+    return -1;
+  }
+  void *p = mmap((void *)PMM_FILE_BASE, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+  // kernels before 4.17 take MAP_FIXED_NOREPLACE as a hint only
+  if (p != (void *)PMM_FILE_BASE) {
+    munmap(p, size);
+    return -1;
+  }
+  sb = p;
+  if (fresh) {
+    pmm_init_area((char *)p + SB_SIZE + CACHELINE_SIZE - sizeof(alloc_header),
+                  size - SB_SIZE - CACHELINE_SIZE);
+    // dropped pages of a shared file mapping come back from the file
+    kmem_default.madvise = 0;
+    *sb = (struct superblock) {
+      .magic = PERSIST_MAGIC,
+      .cpu_num = CPU_NUM,
+      .cpu_pages_size = sizeof(cpu_pages_t),
+      .page_size = PAGE_SIZE,
+      .base = PMM_FILE_BASE,
+      .size = size,
+    };
+    pmm_sync();
+    return 0;
+  }
+  if (!sb_valid(sb, size)) {
+    munmap(p, size);
+    sb = NULL;
+    return -1;
+  }
+  kmem_default.area = (Area) {
+    .start = (char *)p + SB_SIZE + CACHELINE_SIZE - sizeof(alloc_header),
+    .end = (char *)p + size,
+  };
+  kmem_default.madvise = 0;
+  kmem_default.shard_base = sb->shard_base;
+  kmem_default.shard_span = sb->shard_span;
+  // the shards of the run that made the file, whatever this machine has
+  kmem_default.nr_shards = sb->nr_shards;
+  for (int i = 0; i < sb->nr_shards; i++) {
+    kmem_default.shard[i].addr = sb->mem_addr[i];
+    kmem_default.shard[i].obj_cnt = sb->mem_obj_cnt[i];
+    spin_init(&(kmem_default.shard[i].lk));
+    spin_set_class(&(kmem_default.shard[i].lk), LK_BIGMEM);
+  }
+  memcpy(kmem_default.cpu, sb->cpu, sizeof(sb->cpu));
+  kmem_default.kcache_bytes = sb->kcache_bytes;
+  // a chain lock may have been held when the file was last written back
+  for (int i = 0; i < CPU_NUM; i++) {
+    spin_init(&(kmem_default.cpu[i].lk));
+    for (int c = 0; c < NR_CHAINS; c++)
+      if (kmem_default.cpu[i].chain[c] != NULL)
+        spin_init(&(kmem_default.cpu[i].chain[c]->HDR.lock));
+  }
+  for (int c = 0; c < FIRST_MID_CLASS; c++) {
+    kmem_default.orphans[c].list = sb->orphan[c];
+    kmem_default.orphans[c].nr = sb->nr_orphan[c];
+    spin_init(&(kmem_default.orphans[c].lk));
+    spin_set_class(&(kmem_default.orphans[c].lk), LK_ORPHAN);
+    kmem_default.full[c].list = sb->full[c];
+    kmem_default.full[c].nr = sb->nr_full[c];
+    spin_init(&(kmem_default.full[c].lk));
+    spin_set_class(&(kmem_default.full[c].lk), LK_ORPHAN);
+  }
+  return 1;
+}
+
+void pmm_sync() {
+  // cached blocks would have to be saved as well
+  lcache_drain_all(&kmem_default);
+  pmm_lock_all();
+  sb->shard_base = kmem_default.shard_base;
+  sb->shard_span = kmem_default.shard_span;
+  sb->nr_shards = kmem_default.nr_shards;
+  for (int i = 0; i < kmem_default.nr_shards; i++) {
+    sb->mem_addr[i] = kmem_default.shard[i].addr;
+    sb->mem_obj_cnt[i] = kmem_default.shard[i].obj_cnt;
+  }
+  memcpy(sb->cpu, kmem_default.cpu, sizeof(sb->cpu));
+  sb->kcache_bytes = kmem_default.kcache_bytes;
+  for (int c = 0; c < FIRST_MID_CLASS; c++) {
+    sb->orphan[c] = kmem_default.orphans[c].list;
+    sb->nr_orphan[c] = kmem_default.orphans[c].nr;
+    sb->full[c] = kmem_default.full[c].list;
+    sb->nr_full[c] = kmem_default.full[c].nr;
+  }
+  pmm_unlock_all();
+  msync(sb, sb->size, MS_SYNC);
+}
+
+void pmm_close() {
+  pmm_sync();
+  munmap(sb, sb->size);
+  sb = NULL;
+}
+
+// where the application keeps the entry to its data across restarts
+void kheap_set_root(void *p) {
+  sb->root = p;
+}
+
+void *kheap_root() {
+  return sb->root;
+}
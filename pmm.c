@@ -1,68 +1,653 @@
+#define _GNU_SOURCE
 #include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pmm.h"
-#define CPU_NUM 4
+
+// blocks from here on are cleared with non-temporal stores
+#define KZ_STREAM_MIN (256 * 1024)
+
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ
+#endif
+
+kmem_heap kmem_default;
 
 void pmm_init() {
-  char *ptr  = malloc(HEAP_SIZE);
-  heap.start = ptr;
-  heap.end   = ptr + HEAP_SIZE;
-  printf("Got %d MiB heap: [%p, %p)\n", HEAP_SIZE >> 20, heap.start, heap.end);
-  Mem_freenode_head.addr = heap.start;
-  Mem_freenode_head.obj_cnt = 0;
-  spin_init(&(Mem_freenode_head.lk));
-  *(Mem_freenode_head.addr) = (free_node) {
-    .start = heap.start,
-    .len = HEAP_SIZE,
-    .prev = NULL,
-    .next = NULL,
-  };
-  for (int i = 0; i < 4; i++) {
-    // memmove((void *)((uintptr_t)Mem_freenode_head + PAGE_SIZE), Mem_freenode_head, sizeof(free_node));
-    cpu_page_list[i] = page_alloc(i);
-  }
-}
-
-void *kalloc(int tid, size_t size) {
-  int i = 0;
-  for (; i < 32; i++)
-    if (size <= (2 << i))
-      break;
-  size_t small_size = 2 << i;
+  char *ptr  = calloc(1, HEAP_SIZE + CACHELINE_SIZE);
+  pmm_init_area((void *)(ROUNDUP(ptr + sizeof(alloc_header), CACHELINE_SIZE) - sizeof(alloc_header)), HEAP_SIZE);
+  printf("Got %d MiB heap: [%p, %p)\n", HEAP_SIZE >> 20, kmem_default.area.start, kmem_default.area.end);
+}
+
+// sets the allocator up on [start, start + size) without allocating or
+// printing, for callers that cannot re-enter malloc (e.g. the preload shim).
+// start + sizeof(alloc_header) must be cache line aligned (see BIG_SIZE) and
+// size must fit a free_node's len. the area has to read as zero (fresh
+// mmap, calloc), kzalloc relies on it, and be private anonymous memory, or
+// the scavenger's madvise() would not read back as zero (see kmem_heap).
+void pmm_init_area(void *start, size_t size) {
+  pmm_init_heap(&kmem_default, start, size);
+}
+
+void pmm_init_heap(kmem_heap *h, void *start, size_t size) {
+  uintptr_t first = (uintptr_t)start + sizeof(alloc_header);
+  assert(ROUNDUP(first, CACHELINE_SIZE) == first && size <= UINT32_MAX);
+  // chains come with their first allocation
+  size_t map_len = h->map_len;
+  memset(h, 0, sizeof(*h));
+  h->map_len = map_len;
+  h->area.start = start;
+  h->area.end   = (char *)start + size;
+  // whole cache lines, so that every shard starts like the heap does
+  h->madvise = 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  h->nr_shards = cpus < CPU_NUM ? CPU_NUM : cpus > MAX_SHARDS ? MAX_SHARDS : cpus;
+  h->shard_base = (uintptr_t)start;
+  h->shard_span = size / h->nr_shards / CACHELINE_SIZE * CACHELINE_SIZE;
+  for (int i = 0; i < h->nr_shards; i++) {
+    freenode_head_t *sh = &h->shard[i];
+    sh->addr = (free_node *)(h->shard_base + i * h->shard_span);
+    sh->obj_cnt = 0;
+    spin_init(&(sh->lk));
+    spin_set_class(&(sh->lk), LK_BIGMEM);
+    *(sh->addr) = (free_node) {
+      .start = sh->addr,
+      .len = i < h->nr_shards - 1 ? h->shard_span : size - i * h->shard_span,
+      .dirty = sizeof(free_node),
+      .prev = NULL,
+      .next = NULL,
+    };
+  }
+  for (int i = 0; i < CPU_NUM; i++)
+    spin_set_class(&(h->cpu[i].lk), LK_CHAIN);
+  for (int c = 0; c < FIRST_MID_CLASS; c++) {
+    spin_set_class(&(h->full[c].lk), LK_ORPHAN);
+    spin_set_class(&(h->orphans[c].lk), LK_ORPHAN);
+  }
+}
+
+// the area starts one alloc_header below the first cache line behind the
+// kmem_heap, as pmm_init_heap() wants it; a fresh anonymous mapping reads
+// as zero and may be dropped with madvise()
+kmem_heap *pmm_create(size_t size) {
+  size_t off = ROUNDUP(sizeof(kmem_heap) + sizeof(alloc_header), CACHELINE_SIZE) - sizeof(alloc_header);
+  size_t len = ROUNDUP(off + size, PAGE_SIZE);
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  kmem_heap *h = p;
+  h->map_len = len;
+  pmm_init_heap(h, (char *)p + off, size);
+  return h;
+}
+
+// every page, chain and cache of h lives in its mapping: nothing to walk
+void pmm_destroy(kmem_heap *h) {
+  assert(h != &kmem_default && h->map_len != 0);
+  munmap(h, h->map_len);
+}
+
+void pmm_lock_all() {
+  kmem_heap *h = &kmem_default;
+  for (int i = 0; i < CPU_NUM; i++) {
+    spin_lock(&(h->cpu[i].lk));
+    for (int c = 0; c < NR_CHAINS; c++)
+      if (h->cpu[i].chain[c] != NULL)
+        spin_lock(&(h->cpu[i].chain[c]->HDR.lock));
+  }
+  for (int c = 0; c < FIRST_MID_CLASS; c++)
+    spin_lock(&(h->full[c].lk));
+  for (int c = 0; c < FIRST_MID_CLASS; c++)
+    spin_lock(&(h->orphans[c].lk));
+  for (int i = 0; i < CPU_NUM; i++)
+    spin_lock(&(h->lcache[i].lk));
+  for (int i = 0; i < h->nr_shards; i++)
+    spin_lock(&(h->shard[i].lk));
+}
+
+void pmm_unlock_all() {
+  kmem_heap *h = &kmem_default;
+  for (int i = h->nr_shards - 1; i >= 0; i--)
+    spin_unlock(&(h->shard[i].lk));
+  for (int i = CPU_NUM - 1; i >= 0; i--)
+    spin_unlock(&(h->lcache[i].lk));
+  for (int c = FIRST_MID_CLASS - 1; c >= 0; c--)
+    spin_unlock(&(h->orphans[c].lk));
+  for (int c = FIRST_MID_CLASS - 1; c >= 0; c--)
+    spin_unlock(&(h->full[c].lk));
+  for (int i = CPU_NUM - 1; i >= 0; i--) {
+    for (int c = NR_CHAINS - 1; c >= 0; c--)
+      if (h->cpu[i].chain[c] != NULL)
+        spin_unlock(&(h->cpu[i].chain[c]->HDR.lock));
+    spin_unlock(&(h->cpu[i].lk));
+  }
+}
+
+static page_t *class_chain(kmem_heap *h, int tid, int c) {
+  page_t **slot = &h->cpu[tid].chain[c];
+  page_t *span = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (span == NULL) {
+    spin_lock(&(h->cpu[tid].lk));
+    span = *slot;
+    if (span == NULL) {
+      int small = c < FIRST_MID_CLASS;
+      span = small ? orphan_adopt(h, c) : NULL;
+      if (span == NULL)
+        span = page_alloc(h, tid, span_pages[c] * PAGE_SIZE,
+                          small ? class_size[c] + sizeof(alloc_header) : 0);
+      if (span != NULL)
+        spin_set_class(&(span->HDR.lock), small ? LK_CHAIN : LK_MID);
+      __atomic_store_n(slot, span, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&(h->cpu[tid].lk));
+  }
+  return span;
+}
+
+#ifdef LAZY_COALESCE
+/*
+  lazy coalescing: kfree pushes a mid-size block on its CPU's quick list of
+  its class in O(1), without looking for the page or walking a free list.
+  kalloc pops from there first. the address ordered insert and the
+  coalescing happen in quick_flush(), once a list grows past QUICK_MAX or
+  the chain sits idle (kcache_scavenge). small blocks live in slot pages,
+  which take them back in O(1) anyway.
+*/
+#define QUICK_MAX 64
+
+static void *quick_pop(kmem_heap *h, int tid, int c) {
+  cpu_pages_t *cp = &h->cpu[tid];
+  void *p = cp->quick[c];
+  if (p != NULL) {
+    cp->quick[c] = *(void **)p;
+    cp->nr_quick[c]--;
+  }
+  return p;
+}
+
+static int by_address(const void *a, const void *b) {
+  uintptr_t pa = *(uintptr_t *)a, pb = *(uintptr_t *)b;
+  return pa < pb ? -1 : pa > pb;
+}
+
+// caller holds head->HDR.lock
+static void quick_flush(kmem_heap *h, int tid, int c, page_t *head) {
+  cpu_pages_t *cp = &h->cpu[tid];
+  void *blk[QUICK_MAX + 1];
+  int n = 0;
+  for (void *p = cp->quick[c]; p != NULL; p = *(void **)p)
+    blk[n++] = p;
+  cp->quick[c] = NULL;
+  cp->nr_quick[c] = 0;
+  qsort(blk, n, sizeof(blk[0]), by_address);
+  for (int i = 0; i < n; i++)
+    chain_free(h, head, blk[i]);
+}
+
+static void quick_push(kmem_heap *h, int tid, int c, page_t *head, void *ptr) {
+  cpu_pages_t *cp = &h->cpu[tid];
+  *(void **)ptr = cp->quick[c];
+  cp->quick[c] = ptr;
+  if (++cp->nr_quick[c] > QUICK_MAX)
+    quick_flush(h, tid, c, head);
+}
+#endif
+
+// caller holds head->HDR.lock
+static void *chain_alloc(kmem_heap *h, int tid, int c, page_t *head) {
+  if (c < FIRST_MID_CLASS)
+    return slot_alloc(h, head, c, tid);
+#ifdef LAZY_COALESCE
+  void *p = quick_pop(h, tid, c);
+  if (p == NULL)
+    p = split_alloc_fit(h, head, class_size[c], tid);
+  if (p != NULL)
+    return p;
+#endif
+  return split_alloc(h, head, class_size[c], 0, tid);
+}
+
+static inline size_t lcache_len(void *p) {
+  return ((alloc_header *)((uintptr_t)p - sizeof(alloc_header)))->len;
+}
+
+static void *lcache_get(kmem_heap *h, int tid, int pages) {
+  lcache_t *lc = &h->lcache[tid];
+  spin_lock(&(lc->lk));
+  void *p = lc->bucket[pages];
+  if (p != NULL) {
+    lc->bucket[pages] = *(void **)p;
+    lc->bytes -= lcache_len(p);
+  }
+  spin_unlock(&(lc->lk));
+  return p;
+}
+
+// caller holds lc->lk. unlinks blocks, biggest first, until no more than
+// keep bytes are left and returns them as a list.
+static void *lcache_trim(lcache_t *lc, size_t keep) {
+  void *list = NULL;
+  for (int b = LCACHE_PAGES; b > 0 && lc->bytes > keep; b--) {
+    while (lc->bucket[b] != NULL && lc->bytes > keep) {
+      void *p = lc->bucket[b];
+      lc->bucket[b] = *(void **)p;
+      lc->bytes -= lcache_len(p);
+      *(void **)p = list;
+      list = p;
+    }
+  }
+  return list;
+}
+
+// keeps a shard locked for as long as the list stays inside it
+static void lcache_release(kmem_heap *h, void *list) {
+  freenode_head_t *sh = NULL;
+  while (list != NULL) {
+    void *next = *(void **)list;
+    // shards smaller than LCACHE_PAGES pages (small pmm_create() heaps)
+    if (BIGMEM_spans(h, list)) {
+      if (sh != NULL)
+        spin_unlock(&(sh->lk));
+      sh = NULL;
+      BIGMEM_span_free(h, list);
+      list = next;
+      continue;
+    }
+    if (shard_of(h, list) != sh) {
+      if (sh != NULL)
+        spin_unlock(&(sh->lk));
+      sh = shard_of(h, list);
+      spin_lock(&(sh->lk));
+    }
+    BIGMEM_free_locked(sh, list);
+    list = next;
+  }
+  if (sh != NULL)
+    spin_unlock(&(sh->lk));
+}
+
+static void lcache_put(kmem_heap *h, int tid, void *ptr, int pages) {
+  lcache_t *lc = &h->lcache[tid];
+  spin_lock(&(lc->lk));
+  *(void **)ptr = lc->bucket[pages];
+  lc->bucket[pages] = ptr;
+  lc->bytes += lcache_len(ptr);
+  void *spill = lc->bytes > LCACHE_CAP ? lcache_trim(lc, LCACHE_CAP / 2) : NULL;
+  spin_unlock(&(lc->lk));
+  lcache_release(h, spill);
+}
+
+// returns whether there was anything to give back
+int lcache_drain_all(kmem_heap *h) {
+  int drained = 0;
+  for (int i = 0; i < CPU_NUM; i++) {
+    spin_lock(&(h->lcache[i].lk));
+    void *list = lcache_trim(&h->lcache[i], 0);
+    spin_unlock(&(h->lcache[i].lk));
+    drained |= list != NULL;
+    lcache_release(h, list);
+  }
+  return drained;
+}
+
+static void heap_scavenge(kmem_heap *h, int tid);
+
+// *dirty: how many bytes at the start of the block may be non-zero. the
+// profiler and the background scavenger only look after kmem_default: a
+// sample must not outlive its heap, and the other heaps scavenge inline.
+PROF_TEXT static inline void *kalloc_dirty(kmem_heap *h, int tid, size_t size, size_t *dirty) {
   void *p = NULL;
-  if (small_size < PAGE_SIZE) {
-    spin_lock(&(cpu_page_list[tid]->HDR.lock));
-    p = split_alloc(cpu_page_list[tid], small_size, 0, tid);    
-    spin_unlock(&(cpu_page_list[tid]->HDR.lock));
+  int scavenge = 0;
+  *dirty = size;
+  // the roundings below wrap near SIZE_MAX
+  if (size > KALLOC_MAX)
+    return NULL;
+  if (size <= MID_MAX) {
+    int c = size_class(size);
+    page_t *head = class_chain(h, tid, c);
+    if (head == NULL)
+      return NULL;
+    spin_lock(&(head->HDR.lock));
+    p = chain_alloc(h, tid, c, head);
+    h->cpu[tid].cache[c].ops++;
+    scavenge = kcache_tick(&h->cpu[tid]);
+    spin_unlock(&(head->HDR.lock));
   }
   else {
-    spin_lock(&(Mem_freenode_head.lk));
-    p = BIGMEM_split_alloc(size);
-    spin_unlock(&(Mem_freenode_head.lk));
+    int pages = lcache_pages(size);
+    if (pages)
+      p = lcache_get(h, tid, pages);
+    if (p == NULL)
+      p = BIGMEM_alloc(h, tid, pages ? LCACHE_SIZE(size) : size, dirty);
   }
+#ifdef HEAP_PROFILE
+  if (h == &kmem_default && p != NULL && (prof_bytes_left -= size) < 0)
+    prof_sample(p, size);
+#endif
+  if (scavenge && (h != &kmem_default || !__atomic_load_n(&kscav_on, __ATOMIC_RELAXED)))
+    heap_scavenge(h, tid);
   return p;
 }
 
-void kfree(int tid, void *ptr) {
-  alloc_header *ah = ptr - sizeof(alloc_header);
-  if (ah->cpu_id == -1) {
-    BIGMEM_coalescing_free(ptr);
+PROF_TEXT void *kalloc(int tid, size_t size) {
+  size_t dirty;
+  void *p = kalloc_dirty(&kmem_default, tid, size, &dirty);
+  if (p != NULL)
+    KTRACE_EMIT(KT_ALLOC, tid, p, size);
+  return p;
+}
+
+void *kalloc_heap(kmem_heap *h, int tid, size_t size) {
+  size_t dirty;
+  return kalloc_dirty(h, tid, size, &dirty);
+}
+
+// memset, but a block this big is rarely read right after being cleared:
+// streaming stores write around the cache instead of evicting the working
+// set for it. p is ALIGN_SIZE aligned.
+static void clear_block(void *p, size_t n) {
+#ifdef __SSE2__
+  if (n >= KZ_STREAM_MIN) {
+    __m128i z = _mm_setzero_si128();
+    char *c = p, *end = c + (n & ~(size_t)63);
+    for (; c < end; c += 64) {
+      _mm_stream_si128((__m128i *)c, z);
+      _mm_stream_si128((__m128i *)(c + 16), z);
+      _mm_stream_si128((__m128i *)(c + 32), z);
+      _mm_stream_si128((__m128i *)(c + 48), z);
+    }
+    _mm_sfence();
+    memset(c, 0, n & 63);
+    return;
   }
-  else {
-    page_t *tmp_p = cpu_page_list[ah->cpu_id];
-    while (tmp_p != NULL) {
-      if ((uintptr_t)tmp_p <= (uintptr_t)ptr && (uintptr_t)ptr < (uintptr_t)tmp_p + PAGE_SIZE) {
-        break;
+#endif
+  memset(p, 0, n);
+}
+
+// big blocks carved from heap that was never handed out (or has been
+// given back to the OS) are zero already, only their dirty head is cleared
+PROF_TEXT void *kzalloc(int tid, size_t size) {
+  size_t dirty;
+  void *p = kalloc_dirty(&kmem_default, tid, size, &dirty);
+  if (p != NULL) {
+    clear_block(p, dirty < size ? dirty : size);
+    KTRACE_EMIT(KT_ZALLOC, tid, p, size);
+  }
+  return p;
+}
+
+void *kzalloc_heap(kmem_heap *h, int tid, size_t size) {
+  size_t dirty;
+  void *p = kalloc_dirty(h, tid, size, &dirty);
+  if (p != NULL)
+    clear_block(p, dirty < size ? dirty : size);
+  return p;
+}
+
+PROF_TEXT void *kcalloc(int tid, size_t n, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(n, size, &total) || total > KALLOC_MAX)
+    return NULL;
+  return kzalloc(tid, total);
+}
+
+// see the per-CPU page cache in pmm.h. takes the CPU's chain locks one at a
+// time, so it may run from any thread. cp->lk keeps kthread_exit() from
+// taking the chains away meanwhile.
+static void heap_scavenge(kmem_heap *h, int tid) {
+  cpu_pages_t *cp = &h->cpu[tid];
+  spin_lock(&(cp->lk));
+  for (int k = 0; k < NR_CHAINS; k++) {
+    page_t *head = cp->chain[k];
+    if (head == NULL)
+      continue;
+    spin_lock(&(head->HDR.lock));
+    chain_cache_t *cc = &cp->cache[k];
+    uint32_t keep = cc->ops == 0 ? 0 : cc->grown == 0 ? cc->keep / 2 : cc->keep;
+    __atomic_sub_fetch(&h->kcache_bytes, (size_t)(cc->keep - keep) * head->HDR.span, __ATOMIC_RELAXED);
+    cc->keep = keep;
+    cc->grown = cc->ops = 0;
+#ifdef LAZY_COALESCE
+    // an idle chain's quick listed blocks would pin its pages
+    if (keep == 0 && !head->HDR.stride)
+      quick_flush(h, tid, k, head);
+#endif
+    // kfree leaves slot pages to the next lock holder, so their empty ones
+    // are only counted here
+    if (head->HDR.stride) {
+      cc->nr_empty = 0;
+      for (page_t *page = head; (page = (page_t *)page->HDR.nextpage) != NULL; )
+        cc->nr_empty += slot_live(page) == 0;
+    }
+    page_t *prev = head, *page;
+    while (cc->nr_empty > cc->keep && (page = (page_t *)prev->HDR.nextpage) != NULL) {
+      if (head->HDR.stride ? slot_live(page) == 0 : page->HDR.obj_cnt == 0) {
+        prev->HDR.nextpage = page->HDR.nextpage;
+        if (cc->cur == page)
+          cc->cur = NULL;
+        BIGMEM_coalescing_free(h, page);
+        cc->nr_empty--;
       }
-      tmp_p = (page_t *)(tmp_p->HDR.nextpage);
+      else
+        prev = page;
     }
-    if (tmp_p == NULL) {
-      printf("abnormal free, ptr hasn't been allocated.\n");
-      assert(0);
+    spin_unlock(&(head->HDR.lock));
+  }
+  spin_unlock(&(cp->lk));
+}
+
+void kcache_scavenge(int tid) {
+  heap_scavenge(&kmem_default, tid);
+}
+
+// see kthread_attach() in pmm.h
+void kthread_exit(int tid) {
+  kmem_heap *h = &kmem_default;
+  cpu_pages_t *cp = &h->cpu[tid];
+  kepoch_offline(tid);
+  spin_lock(&(h->lcache[tid].lk));
+  void *list = lcache_trim(&h->lcache[tid], 0);
+  spin_unlock(&(h->lcache[tid].lk));
+  lcache_release(h, list);
+
+  // pages leaving the CPU, linked through HDR.nextpage
+  page_t *gone = NULL;
+  spin_lock(&(cp->lk));
+  for (int c = 0; c < NR_CHAINS; c++) {
+    page_t *head = cp->chain[c], *prev = head, *page;
+    if (head == NULL)
+      continue;
+    spin_lock(&(head->HDR.lock));
+#ifdef LAZY_COALESCE
+    if (!head->HDR.stride)
+      quick_flush(h, tid, c, head);
+#endif
+    // a mid-size block's kfree finds its page through the chain, so a
+    // chain holding one stays, with its empty pages gone
+    if (!head->HDR.stride) {
+      while ((page = (page_t *)prev->HDR.nextpage) != NULL) {
+        if (page->HDR.obj_cnt == 0) {
+          prev->HDR.nextpage = page->HDR.nextpage;
+          page->HDR.nextpage = (header_t *)gone;
+          gone = page;
+        }
+        else
+          prev = page;
+      }
+    }
+    int detach = head->HDR.stride || (head->HDR.obj_cnt == 0 && head->HDR.nextpage == NULL);
+    __atomic_sub_fetch(&h->kcache_bytes, (size_t)cp->cache[c].keep * head->HDR.span, __ATOMIC_RELAXED);
+    cp->cache[c] = (chain_cache_t) {.nr_empty = 0};
+    if (detach)
+      __atomic_store_n(&cp->chain[c], NULL, __ATOMIC_RELAXED);
+    spin_unlock(&(head->HDR.lock));
+    for (page = detach ? head : NULL; page != NULL; page = prev) {
+      prev = (page_t *)page->HDR.nextpage;
+      page->HDR.nextpage = (header_t *)gone;
+      gone = page;
     }
-    coalescing_free(tmp_p, ptr);
+  }
+  spin_unlock(&(cp->lk));
+
+  // nobody reaches these pages through a chain any more; remote frees only
+  // ever push onto their slot stacks
+  while (gone != NULL) {
+    page_t *page = gone;
+    gone = (page_t *)page->HDR.nextpage;
+    if (page->HDR.stride && slot_live(page) != 0)
+      slot_park(h, page);
+    else
+      BIGMEM_coalescing_free(h, page);
   }
 }
 
+void kfree_orphans() {
+  kmem_heap *h = &kmem_default;
+  for (int c = 0; c < FIRST_MID_CLASS; c++) {
+    orphan_list_t *ol = &h->orphans[c];
+    if (__atomic_load_n(&ol->list, __ATOMIC_RELAXED) == NULL)
+      continue;
+    page_t *empty = NULL, *page;
+    spin_lock(&(ol->lk));
+    for (page_t **pp = &ol->list; (page = *pp) != NULL; ) {
+      if (slot_live(page) == 0) {
+        __atomic_store_n(pp, (page_t *)page->HDR.nextpage, __ATOMIC_RELAXED);
+        page->HDR.nextpage = (header_t *)empty;
+        empty = page;
+        ol->nr--;
+      }
+      else
+        pp = (page_t **)&page->HDR.nextpage;
+    }
+    spin_unlock(&(ol->lk));
+    while ((page = empty) != NULL) {
+      empty = (page_t *)page->HDR.nextpage;
+      BIGMEM_coalescing_free(h, page);
+    }
+  }
+}
+
+static pthread_key_t kthread_key;
+static pthread_once_t kthread_once = PTHREAD_ONCE_INIT;
+static int kthread_key_err;
+
+static void kthread_dtor(void *v) {
+  kthread_exit((int)(intptr_t)v - 1);
+}
+
+static void kthread_key_init() {
+  kthread_key_err = pthread_key_create(&kthread_key, kthread_dtor);
+}
+
+// 0 on success, -1 when the key cannot be had
+int kthread_attach(int tid) {
+  pthread_once(&kthread_once, kthread_key_init);
+  if (kthread_key_err != 0)
+    return -1;
+  // the destructor only runs for a non-NULL value
+  return pthread_setspecific(kthread_key, (void *)(intptr_t)(tid + 1)) == 0 ? 0 : -1;
+}
+
+static inline void big_free(kmem_heap *h, int tid, void *ptr, size_t len) {
+  int pages = lcache_pages(len);
+  if (pages)
+    lcache_put(h, tid, ptr, pages);
+  else
+    BIGMEM_coalescing_free(h, ptr);
+}
+
+static inline void mid_free(kmem_heap *h, int cpu, int c, void *ptr) {
+  page_t *head = h->cpu[cpu].chain[c];
+  spin_lock(&(head->HDR.lock));
+#ifdef LAZY_COALESCE
+  quick_push(h, cpu, c, head, ptr);
+#else
+  chain_free(h, head, ptr);
+#endif
+  spin_unlock(&(head->HDR.lock));
+}
+
+// ah is ptr's alloc_header
+static inline void heap_free(kmem_heap *h, int tid, void *ptr, alloc_header *ah) {
+  if (ah->cpu_id == -1)
+    big_free(h, tid, ptr, ah->len);
+  else if (ah->slot != 0)
+    slot_free(h, ptr);
+  else
+    mid_free(h, ah->cpu_id, size_class(ah->len), ptr);
+}
 
+void kfree(int tid, void *ptr) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+  // before the block can be handed out again, see trace.c
+  KTRACE_EMIT(KT_FREE, tid, ptr, ah->len);
+#ifdef HEAP_PROFILE
+  if (ah->sampled)
+    prof_forget(ptr);
+#endif
+  heap_free(&kmem_default, tid, ptr, ah);
+}
+
+void kfree_heap(kmem_heap *h, int tid, void *ptr) {
+#ifdef DEBUG
+  assert((void *)ptr > h->area.start && (void *)ptr < h->area.end);
+#endif
+  heap_free(h, tid, ptr, ptr - sizeof(alloc_header));
+}
 
+// size is what was passed to kalloc: it picks the path, the header is only
+// read for the owning CPU of a mid-size block
+void kfree_sized(int tid, void *ptr, size_t size) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+#ifdef DEBUG
+  assert(ah->magic == 0x6d616c63 && ah->len == kalloc_size(size));
+#endif
+  KTRACE_EMIT(KT_FREE, tid, ptr, ah->len);
+#ifdef HEAP_PROFILE
+  if (ah->sampled)
+    prof_forget(ptr);
+#endif
+  if (size <= SMALL_MAX)
+    slot_free(&kmem_default, ptr);
+  else if (size <= MID_MAX)
+    mid_free(&kmem_default, ah->cpu_id, size_class(size), ptr);
+  else
+    big_free(&kmem_default, tid, ptr, size);
+}
 
+// the CPU the caller runs on, as the kernel numbers it. glibc registers an
+// rseq area for every thread, whose cpu_id the kernel keeps current: one
+// load, no syscall. without rseq (old glibc/kernel, or glibc.pthread.rseq=0)
+// use sched_getcpu(). 0 when neither tells.
+int cpu_raw() {
+#ifdef HAVE_RSEQ
+  if (__rseq_size > 0) {
+    struct rseq *rs = (struct rseq *)((uintptr_t)__builtin_thread_pointer() + __rseq_offset);
+    int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+    if (cpu >= 0)
+      return cpu;
+  }
+#endif
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu;
+}
+
+// the heap of the CPU the caller runs on: several CPUs share one when the
+// machine has more than CPU_NUM
+int cpu_current() {
+  return cpu_raw() % CPU_NUM;
+}
+
+PROF_TEXT void *kalloc_cur(size_t size) {
+  return kalloc(cpu_current(), size);
+}
+
+void kfree_cur(void *ptr) {
+  kfree(cpu_current(), ptr);
+}
@@ -1,10 +1,21 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
 #include "spinlock.h"
 #define HEAP_SIZE 1024u*1024u*1024u
+// a power of two; span_pages[] still fits every class from 4096 up
+#ifndef PAGE_SIZE
 #define PAGE_SIZE 8192
+#endif
 #define HDR_SIZE sizeof(header_t)
+#define ALIGN_SIZE 16
+#define CACHELINE_SIZE 64
+#define MAX_CPU 128
+#ifndef CPU_NUM
+#define CPU_NUM 4
+#endif
+#define ROUNDUP(a, sz) ((((uintptr_t)a) + (sz) - 1) & ~((uintptr_t)(sz) - 1))
 
 #define LinkListCheck(p)                         \
   assert(p->next == NULL || p->next->prev == p); \
@@ -23,12 +34,81 @@ typedef struct header header_t;
 
 // ============= alloc header ==============
 
+// 16 bytes, so that every user pointer keeps malloc's ALIGN_SIZE alignment
 typedef struct
 {
   int  cpu_id;
   uint32_t len;
   uint32_t magic;
-} alloc_header;
+  uint16_t sampled; // picked by the heap profiler (heapprof.c)
+  uint16_t slot;    // slot pages: ALIGN_SIZE units back to the page, else 0
+} __attribute__((aligned(ALIGN_SIZE))) alloc_header;
+
+// big blocks (and so pages) start on a cache line: the heap begins one
+// alloc_header below a line and every big chunk spans whole lines.
+#define BIG_SIZE(sz) (ROUNDUP((sz) + sizeof(alloc_header), CACHELINE_SIZE) - sizeof(alloc_header))
+
+// ============== size classes ==============
+
+/*
+  16 byte steps up to 128, then 4 classes per doubling:
+    16, 32, .., 128, 160, 192, 224, 256, 320, .., 2048, 2560, .., 28672, 32768
+  every class (up to MID_MAX) has per-CPU spans of span_pages[] pages
+  holding objects of that class only: slot pages up to SMALL_MAX (see
+  slot_alloc), free list pages above. bigger requests go to BIGMEM.
+*/
+#define SMALL_MAX 2048
+#define MID_MAX 32768
+#define NR_CLASSES 40
+#define FIRST_MID_CLASS 24
+#define NR_MID_CLASSES (NR_CLASSES - FIRST_MID_CLASS)
+
+static const uint32_t class_size[NR_CLASSES] = {
+     16,    32,    48,    64,    80,    96,   112,   128,
+    160,   192,   224,   256,   320,   384,   448,   512,
+    640,   768,   896,  1024,  1280,  1536,  1792,  2048,
+   2560,  3072,  3584,  4096,  5120,  6144,  7168,  8192,
+  10240, 12288, 14336, 16384, 20480, 24576, 28672, 32768,
+};
+
+// the smallest span wasting at most ~1/16 of itself (HDR_SIZE 128, PAGE_SIZE 8192)
+static const uint8_t span_pages[NR_CLASSES] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 2, 2, 1, 1, 3, 4, 1, 2, 4, 8, 2, 4, 8, 16,
+  4, 8, 9, 15, 8, 16, 11, 13,
+};
+_Static_assert(PAGE_SIZE >= 4096 && (PAGE_SIZE & (PAGE_SIZE - 1)) == 0, "PAGE_SIZE: a power of two, 4096 or more");
+
+// size <= MID_MAX. constant folds when size is a compile time constant.
+static inline int size_class(size_t size) {
+  if (size <= 128)
+    return size == 0 ? 0 : (size - 1) >> 4;
+  int k = 63 - __builtin_clzl(size - 1); // size in (2^k, 2^(k+1)]
+  return 8 + (k - 7) * 4 + ((size - 1 - (1ul << k)) >> (k - 2));
+}
+
+// the largest request any heap may serve: no block outgrows the default
+// heap, and alloc_header.len holds its length in 32 bits
+#define KALLOC_MAX ((size_t)(HEAP_SIZE))
+
+// bytes kalloc(size) actually reserves for the caller
+// big blocks of up to LCACHE_PAGES pages, header included, take whole
+// pages: a freed one then serves any later request of the same page count
+// from the per-CPU large block cache (see lcache_t)
+#define LCACHE_PAGES 64
+#define LCACHE_SIZE(sz) (ROUNDUP((sz) + sizeof(alloc_header), PAGE_SIZE) - sizeof(alloc_header))
+
+// the page count of big block size len, 0 if it is too big to be cached
+static inline int lcache_pages(size_t len) {
+  size_t pages = (len + sizeof(alloc_header) + PAGE_SIZE - 1) / PAGE_SIZE;
+  return pages <= LCACHE_PAGES ? pages : 0;
+}
+
+static inline size_t kalloc_size(size_t size) {
+  if (size <= MID_MAX)
+    return class_size[size_class(size)];
+  return lcache_pages(size) ? LCACHE_SIZE(size) : BIG_SIZE(size);
+}
 
 // ============== free list ==============
 
@@ -37,6 +117,9 @@ struct freenode
 {
   void *start;
   uint32_t len;
+  // only the first dirty bytes of the node may be non-zero (BIGMEM list
+  // only): the heap starts out zero and a free()d block is dirty throughout
+  uint32_t dirty;
   free_node *prev;
   free_node *next;
 };
@@ -47,13 +130,22 @@ struct freelist
   free_node *head;
 };
 
+// the lock, the metadata and the first object each get their own cache line:
+// remote CPUs hammering the lock (or the remote slot stack) do not steal the
+// owner's free list.
 struct header
 {
   spinlock_t lock;    // 锁，用于串行化分配和并发的 free
-  int obj_cnt;        // 页面中已分配的对象数，减少到 0 时回收页面
+  uint64_t remote;    // slot pages: kfree's stack, see slot_alloc
+  int obj_cnt __attribute__((aligned(CACHELINE_SIZE))); // 页面中已分配的对象数，减少到 0 时回收页面
+  uint32_t span;      // bytes, PAGE_SIZE or a class span
   header_t *nextpage; // 属于同一个线程的 *页面的链表*
-  free_list freelist;
-} __attribute__((packed));
+  free_list freelist; // free list pages only
+  uint32_t stride;    // slot pages: alloc_header + class size, else 0
+  uint32_t local;     // slot pages: top of the lock holder's stack
+  uint32_t bump;      // slot pages: first slot never handed out
+  header_t *prevpage; // slot pages on a full list, see slot_retire
+} __attribute__((aligned(CACHELINE_SIZE)));
 
 union page
 {
@@ -65,18 +157,162 @@ union page
   } __attribute__((packed));
 };
 
-struct {
-  free_node *addr;
+typedef struct {
   spinlock_t lk;
+  free_node *addr __attribute__((aligned(CACHELINE_SIZE)));
   int obj_cnt;
-} Mem_freenode_head;
+  uint32_t ops;  // allocations and frees, the scavenger tells idle shards by it
+} __attribute__((aligned(CACHELINE_SIZE))) freenode_head_t;
 
-#ifdef TEST // memmove
-#include <string.h>
-#include <stdio.h>
-#include <assert.h>
+/*
+    BIGMEM is cut into nr_shards address ranges of shard_span bytes
+    (the last one also takes what is left over), each with its own
+    free_node list and lock. nr_shards is the number of online CPUs, at
+    least CPU_NUM and at most MAX_SHARDS, taken when the heap is set up.
+    an allocation starts at the home shard of its CPU and only moves on to
+    a neighbour, preferring one whose lock is free right now, when that has
+    no fit; a block always goes back to the shard its address falls in.
+    free nodes so never cross a shard boundary.
+
+    a block bigger than a shard is the exception: BIGMEM_span_alloc() takes
+    every shard lock and carves it from a run of shards free throughout,
+    the last one only up to what the block needs. its kfree hands each
+    shard its piece back (BIGMEM_span_free). the largest block so stays
+    about the size of the heap, as long as enough whole shards are free.
+*/
+#ifndef MAX_SHARDS
+#define MAX_SHARDS 64
 #endif
 
+// the CPU the caller runs on, as the kernel numbers it (pmm.c)
+int cpu_raw();
+
+/*
+    per-CPU large block cache: kfree parks a page rounded big block in the
+    bucket of its page count on the freeing CPU, kalloc takes it back from
+    there, neither touching a BIGMEM shard lock. once a CPU holds more than
+    LCACHE_CAP bytes the bigger half goes back to BIGMEM, and every cache is
+    drained when BIGMEM runs dry. the link lives in the first payload word,
+    the alloc_header stays as kalloc wrote it.
+*/
+#define LCACHE_CAP (4u << 20)
+
+typedef struct {
+  spinlock_t lk;
+  void *bucket[LCACHE_PAGES + 1];
+  size_t bytes;
+} __attribute__((aligned(CACHELINE_SIZE))) lcache_t;
+
+// slot pages in no chain, per small class, see slot_alloc: orphans, each
+// with a free slot, and full pages (linked both ways)
+typedef struct {
+  spinlock_t lk;
+  page_t *list;  // linked through HDR.nextpage
+  uint32_t nr;
+} __attribute__((aligned(CACHELINE_SIZE))) orphan_list_t;
+
+/*
+    per-CPU page cache: pages (other than a chain's head) that hold no
+    object stay in their chain, so that alloc/free cycles around a page
+    boundary do not take a BIGMEM shard lock every time. kcache_scavenge(),
+    run every KCACHE_PERIOD allocations from the chains of a CPU, trims each
+    of that CPU's chains down to `keep` empty pages and hands the rest back
+    to BIGMEM. a chain that had to grow raises its keep, doubling it within
+    KCACHE_BUDGET bytes for the whole heap; a round without growth
+    halves it, and a round without a single allocation drops it to zero.
+*/
+#ifndef KCACHE_BUDGET
+#define KCACHE_BUDGET (32u << 20)
+#endif
+#define KCACHE_PERIOD 4096
+
+typedef struct {
+  uint32_t nr_empty; // pages other than the head without a live object
+  uint32_t keep;     // empty pages the chain may hold on to
+  uint32_t grown;    // page_alloc()s since the last scavenge
+  uint32_t ops;      // allocations since the last scavenge
+  page_t *cur;       // slot chains: where the last allocation came from
+} chain_cache_t;
+
+// one chain per class
+#define NR_CHAINS NR_CLASSES
+
+// one line per CPU, so per-CPU state never shares a line with a neighbour's
+typedef struct {
+  spinlock_t lk;      // creates chains
+  // first page of each class's chain, created on first use under lk. its
+  // HDR.lock guards the chain.
+  page_t *chain[NR_CHAINS];
+#ifdef LAZY_COALESCE
+  // freed mid-size blocks not yet back in their page's free list, guarded
+  // by the lock of the class's chain. the link lives in the first payload
+  // word.
+  void *quick[NR_CLASSES];
+  int nr_quick[NR_CLASSES];
+#endif
+  uint32_t ticks;     // allocations towards the next scavenge
+  chain_cache_t cache[NR_CHAINS]; // guarded by the lock of the chain
+} __attribute__((aligned(CACHELINE_SIZE))) cpu_pages_t;
+
+// ============== heap ==============
+
+typedef struct {
+  void *start, *end;
+} Area;
+
+/*
+    the whole state of one allocator. kmem_default is the heap pmm_init(),
+    pmm_init_area() and pmm_open() set up, and the one kalloc, kfree and
+    everything else taking only a tid work on: deferred frees, the
+    scavenger, thread exit, tracing, the inline fast path and the preload
+    shim.
+
+    pmm_create() maps further heaps, each with its kmem_heap at the start of
+    its own mapping. they share no lock, page or cache with any other heap;
+    their blocks go through kalloc_heap()/kfree_heap() and pmm_destroy()
+    drops one with everything still allocated in it by a single munmap().
+*/
+typedef struct kmem_heap {
+  Area area;
+  freenode_head_t shard[MAX_SHARDS];
+  int nr_shards;
+  uintptr_t shard_base;
+  size_t shard_span;
+  // free BIGMEM pages may be dropped with MADV_DONTNEED and read back as
+  // zero: not so for the file backed heap
+  int madvise;
+  cpu_pages_t cpu[CPU_NUM];
+  lcache_t lcache[CPU_NUM];
+  size_t kcache_bytes; // sum of keep * span over every chain
+  orphan_list_t orphans[FIRST_MID_CLASS];
+  orphan_list_t full[FIRST_MID_CLASS];
+  size_t map_len;      // pmm_create()d heaps: of the mapping, else 0
+} kmem_heap;
+
+extern kmem_heap kmem_default;
+
+static inline int shard_index(kmem_heap *h, void *ptr) {
+  size_t i = ((uintptr_t)ptr - h->shard_base) / h->shard_span;
+  return i < h->nr_shards ? i : h->nr_shards - 1;
+}
+
+static inline freenode_head_t *shard_of(kmem_heap *h, void *ptr) {
+  return &h->shard[shard_index(h, ptr)];
+}
+
+// the first address of shard i, the end of the heap for i == nr_shards
+static inline uintptr_t shard_start(kmem_heap *h, int i) {
+  return i < h->nr_shards ? h->shard_base + i * h->shard_span : (uintptr_t)h->area.end;
+}
+
+// whether the big block at ptr runs past the end of its shard
+static inline int BIGMEM_spans(kmem_heap *h, void *ptr) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+  return (uintptr_t)ptr + ah->len > shard_start(h, shard_index(h, ptr) + 1);
+}
+
+int lcache_drain_all(kmem_heap *h);
+
 static free_node *freenode_walker(free_node *p, size_t size) {
   while (p != NULL) {
     LinkListCheck(p);
@@ -108,20 +344,28 @@ static void *policy_FirstFit(page_t **p, size_t size) {
   return NULL;
 }
 
-static void *BIGMEM_split_alloc(size_t size) {
-  free_node *fp = freenode_walker(Mem_freenode_head.addr, size);
+// *dirty (if given) is set to how many bytes at the start of the block may
+// be non-zero, the rest is known to be zero
+// caller holds sh->lk
+static void *BIGMEM_split_alloc(freenode_head_t *sh, size_t size, size_t *dirty) {
+  size = BIG_SIZE(size);
+  free_node *fp = freenode_walker(sh->addr, size);
   if (fp == NULL) {
     return NULL;
   }
-  free_node *new_fp = (free_node *)((uintptr_t)fp + size + sizeof(alloc_header));
+  size_t taken = size + sizeof(alloc_header);
+  if (dirty != NULL)
+    *dirty = fp->dirty >= taken ? size : fp->dirty - sizeof(alloc_header);
+  free_node *new_fp = (free_node *)((uintptr_t)fp + taken);
   memmove(new_fp, fp, sizeof(free_node));
-  new_fp->len -= (size + sizeof(alloc_header));
+  new_fp->len -= taken;
+  new_fp->dirty = fp->dirty > taken + sizeof(free_node) ? fp->dirty - taken : sizeof(free_node);
   new_fp->start = (void *)((uintptr_t)fp + sizeof(alloc_header));
   if (new_fp->prev == NULL) {
     // FIXME: DATA RACE ...
-    Mem_freenode_head.addr = new_fp;
+    sh->addr = new_fp;
     if (new_fp->next != NULL)
-      new_fp->next->prev = Mem_freenode_head.addr;
+      new_fp->next->prev = sh->addr;
   }
   else {
     fp->prev->next = new_fp;
@@ -134,37 +378,134 @@ static void *BIGMEM_split_alloc(size_t size) {
     .len = size,
     .magic = 0x6d616c63,
   };
-  Mem_freenode_head.obj_cnt ++;
+  sh->obj_cnt ++;
+  sh->ops ++;
   assert(new_fp->len <= HEAP_SIZE);
   void *up = (void *)((uintptr_t)fp + sizeof(alloc_header));
   return up;
 }
 
-static page_t *page_alloc(int tid)
+// a block of more than a shard, see BIGMEM above. it starts where a shard
+// free throughout does, takes the shards behind it as long as they are
+// free throughout as well, and the rest from the free head of the last one.
+static void *BIGMEM_span_alloc(kmem_heap *h, size_t size, size_t *dirty) {
+  size = BIG_SIZE(size);
+  size_t need = size + sizeof(alloc_header);
+  void *p = NULL;
+  for (int i = 0; i < h->nr_shards; i++)
+    spin_lock(&(h->shard[i].lk));
+  for (int i = 0; p == NULL && i < h->nr_shards; i++) {
+    size_t got = 0;
+    int j;
+    for (j = i; got < need && j < h->nr_shards; j++) {
+      free_node *fp = h->shard[j].addr;
+      size_t cap = shard_start(h, j + 1) - shard_start(h, j), rest = need - got;
+      if (fp == NULL || (uintptr_t)fp != shard_start(h, j))
+        break;
+      if (rest >= cap ? fp->len != cap : fp->len != rest && fp->len < rest + sizeof(free_node))
+        break;
+      got += rest >= cap ? cap : rest;
+    }
+    if (got < need)
+      continue;
+    // shards i..j-1 are the block's now, the last one maybe only in part
+    for (int k = i; k < j; k++) {
+      freenode_head_t *sh = &h->shard[k];
+      free_node *fp = sh->addr;
+      size_t rest = need - (shard_start(h, k) - shard_start(h, i));
+      if (fp->len <= rest)
+        sh->addr = fp->next;
+      else {
+        free_node *new_fp = (free_node *)((uintptr_t)fp + rest);
+        memmove(new_fp, fp, sizeof(free_node));
+        new_fp->len -= rest;
+        new_fp->dirty = fp->dirty > rest + sizeof(free_node) ? fp->dirty - rest : sizeof(free_node);
+        new_fp->start = (void *)((uintptr_t)fp + sizeof(alloc_header));
+        sh->addr = new_fp;
+      }
+      if (sh->addr != NULL)
+        sh->addr->prev = NULL;
+      sh->ops++;
+    }
+    *(alloc_header *)shard_start(h, i) = (alloc_header) {
+      .cpu_id = -1,
+      .len = size,
+      .magic = 0x6d616c63,
+    };
+    h->shard[i].obj_cnt++;
+    p = (void *)(shard_start(h, i) + sizeof(alloc_header));
+  }
+  for (int i = h->nr_shards - 1; i >= 0; i--)
+    spin_unlock(&(h->shard[i].lk));
+  if (p != NULL && dirty != NULL)
+    *dirty = size;
+  return p;
+}
+
+// the home shard first, then the neighbours whose lock is free, and only
+// then waits for the busy ones. with every shard out of fits the large
+// block caches go back to BIGMEM and the search starts over. tids only go
+// up to CPU_NUM: with more shards than that, home is where the caller runs.
+static void *BIGMEM_alloc(kmem_heap *h, int tid, size_t size, size_t *dirty) {
+  int nr = h->nr_shards;
+  int home = (nr > CPU_NUM ? cpu_raw() : tid) % nr;
+  char busy[MAX_SHARDS] = {0};
+  void *p = NULL;
+  for (int k = 0; p == NULL && k < nr; k++) {
+    freenode_head_t *sh = &h->shard[(home + k) % nr];
+    if (k == 0)
+      spin_lock(&(sh->lk));
+    else if (!spin_trylock(&(sh->lk))) {
+      busy[k] = 1;
+      continue;
+    }
+    p = BIGMEM_split_alloc(sh, size, dirty);
+    spin_unlock(&(sh->lk));
+  }
+  for (int k = 1; p == NULL && k < nr; k++) {
+    if (!busy[k])
+      continue;
+    freenode_head_t *sh = &h->shard[(home + k) % nr];
+    spin_lock(&(sh->lk));
+    p = BIGMEM_split_alloc(sh, size, dirty);
+    spin_unlock(&(sh->lk));
+  }
+  if (p == NULL && lcache_drain_all(h))
+    return BIGMEM_alloc(h, tid, size, dirty);
+  if (p == NULL && BIG_SIZE(size) + sizeof(alloc_header) > h->shard_span)
+    p = BIGMEM_span_alloc(h, size, dirty);
+  return p;
+}
+
+// a slot page when stride is given, a free list page otherwise
+static page_t *page_alloc(kmem_heap *h, int tid, size_t span, uint32_t stride)
 {
-  // if ((uintptr_t)p + PAGE_SIZE >= (uintptr_t)heap.end)
+  // if ((uintptr_t)p + PAGE_SIZE >= (uintptr_t)h->area.end)
   //   return NULL;
-  spin_lock(&(Mem_freenode_head.lk));
-  void *p = BIGMEM_split_alloc(PAGE_SIZE);
-  spin_unlock(&(Mem_freenode_head.lk));
+  void *p = BIGMEM_alloc(h, tid, span, NULL);
   if (p == NULL)
     return NULL;
   *(page_t *)(p) = (page_t){
     .HDR = (header_t){
         .obj_cnt = 0,
+        .span = span,
         .nextpage = NULL,
         .freelist = (free_list){
-            .head = (free_node *)((uintptr_t)p + sizeof(spinlock_t) + sizeof(int) + sizeof(header_t *) + sizeof(free_list)),
-        }
+            .head = stride ? NULL : (free_node *)((uintptr_t)p + HDR_SIZE),
+        },
+        .stride = stride,
+        .bump = HDR_SIZE,
     }
   };
+  spin_init(&(((page_t *)p)->HDR.lock));
+  if (stride)
+    return (page_t *)p;
   *(((page_t *)p)->HDR.freelist.head) = (free_node){
     .start = p + HDR_SIZE,
-    .len = PAGE_SIZE - 28,
+    .len = span - HDR_SIZE,
     .next = NULL,
     .prev = NULL,
   };
-  spin_init(&(((page_t *)p)->HDR.lock));
   return (page_t *)p;
 }
 
@@ -174,6 +515,7 @@ static void _free(free_node **p, void *ptr) {
   size_t sz = ah->len;
   free_node *fp = (free_node *)ah;
   fp->len = sz + sizeof(alloc_header);
+  fp->dirty = fp->len;
   fp->start = (void *)fp + sizeof(free_node);
 
   free_node *tp = *p;
@@ -228,7 +570,9 @@ static void _free(free_node **p, void *ptr) {
 
   // compare fp, fp->prev and fp->next.
 COALESCING:
+  // a merged node is dirty up to where the dirty part of its upper half ends
   if (fp->prev != NULL && (uintptr_t)fp == (uintptr_t)fp->prev + fp->prev->len) {
+    fp->prev->dirty = fp->prev->len + fp->dirty;
     fp->prev->len += fp->len;
     fp->prev->next = fp->next;
     fp->prev->next->prev = fp->prev;
@@ -236,6 +580,7 @@ COALESCING:
   }
   else if ((uintptr_t)fp + fp->len == (uintptr_t)fp->next) {
     // FIXME: ...
+    fp->dirty = fp->len + fp->next->dirty;
     fp->len += fp->next->len;
     fp->next = fp->next->next;
     if (fp->next != NULL)
@@ -243,6 +588,7 @@ COALESCING:
     LinkListCheck(fp);
   }
   if (fp->prev != NULL && (uintptr_t)fp->prev + fp->prev->len == (uintptr_t)fp->next) {
+    fp->prev->dirty = fp->prev->len + fp->next->dirty;
     fp->prev->len += fp->next->len;
     fp->prev->next = fp->next->next;
     if (fp->prev->next != NULL)
@@ -251,32 +597,99 @@ COALESCING:
   }
 }
 
-static void BIGMEM_coalescing_free(void *ptr) {
-  spin_lock(&(Mem_freenode_head.lk));
-  _free(&(Mem_freenode_head.addr), ptr);
-  Mem_freenode_head.obj_cnt--;
-  spin_unlock(&(Mem_freenode_head.lk));
+// caller holds sh->lk, sh == shard_of(ptr), and ptr does not span shards
+static void BIGMEM_free_locked(freenode_head_t *sh, void *ptr) {
+  _free(&(sh->addr), ptr);
+  sh->obj_cnt--;
+  sh->ops++;
+}
+
+// a block of BIGMEM_span_alloc(): every shard it runs over gets its piece
+// back as a free block of its own, so that no free node crosses a boundary
+static void BIGMEM_span_free(kmem_heap *h, void *ptr) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+  uintptr_t end = (uintptr_t)ptr + ah->len;
+  int first = shard_index(h, ptr), last = shard_index(h, (void *)(end - 1));
+  for (int k = first; k <= last; k++)
+    spin_lock(&(h->shard[k].lk));
+  for (int k = first; k <= last; k++) {
+    uintptr_t lo = k == first ? (uintptr_t)ah : shard_start(h, k);
+    uintptr_t hi = k == last ? end : shard_start(h, k + 1);
+    *(alloc_header *)lo = (alloc_header) {
+      .cpu_id = -1,
+      .len = hi - lo - sizeof(alloc_header),
+      .magic = 0x6d616c63,
+    };
+    _free(&(h->shard[k].addr), (void *)(lo + sizeof(alloc_header)));
+    h->shard[k].ops++;
+  }
+  h->shard[first].obj_cnt--;
+  for (int k = last; k >= first; k--)
+    spin_unlock(&(h->shard[k].lk));
+}
+
+static void BIGMEM_coalescing_free(kmem_heap *h, void *ptr) {
+  if (BIGMEM_spans(h, ptr)) {
+    BIGMEM_span_free(h, ptr);
+    return;
+  }
+  freenode_head_t *sh = shard_of(h, ptr);
+  spin_lock(&(sh->lk));
+  BIGMEM_free_locked(sh, ptr);
+  spin_unlock(&(sh->lk));
 }
 
 // static void page_free(page_t *page) {
 //   // TODO: ...  
 // }
 
+// the chain of h holding a block of class size len allocated by cpu
+static inline page_t *chain_of(kmem_heap *h, int cpu, size_t len) {
+  return h->cpu[cpu].chain[size_class(len)];
+}
+
+static inline int chain_slot(size_t len) {
+  return size_class(len);
+}
+
+void kcache_scavenge(int tid);
+
+// whether the CPU is due a scavenge. lock holders of two of its chains may
+// race here and lose a tick, which only puts the scavenge off a little.
+static inline int kcache_tick(cpu_pages_t *cp) {
+  uint32_t t = __atomic_load_n(&cp->ticks, __ATOMIC_RELAXED) + 1;
+  __atomic_store_n(&cp->ticks, t == KCACHE_PERIOD ? 0 : t, __ATOMIC_RELAXED);
+  return t == KCACHE_PERIOD;
+}
+
+// a chain that had to grow may keep twice as many empty pages
+static void kcache_grow(kmem_heap *h, chain_cache_t *cc, size_t span) {
+  uint32_t more = cc->keep ? cc->keep : 1;
+  if (__atomic_add_fetch(&h->kcache_bytes, more * span, __ATOMIC_RELAXED) > KCACHE_BUDGET) {
+    __atomic_sub_fetch(&h->kcache_bytes, more * span, __ATOMIC_RELAXED);
+    return;
+  }
+  cc->keep += more;
+}
+
+// caller holds the lock of the page chain head: split_alloc runs under that
+// lock for every page of the chain, so a remote free must take it as well.
 static void coalescing_free(page_t *page, void* ptr)
 {
-  spin_lock(&(page->HDR.lock));
   _free(&(page->HDR.freelist.head), ptr);
   page->HDR.obj_cnt --;
   // if (page->HDR.obj_cnt == 0)
   //   page_free(page);
-  spin_unlock(&(page->HDR.lock));
 }
 
-static void *split_alloc(page_t *page, size_t size, int recusive_flag, int tid) {
+// first fit within the pages the chain already has, NULL if nothing fits
+static void *split_alloc_fit(kmem_heap *h, page_t *page, size_t size, int tid) {
   page_t *t_p_page = page;
   
   // seperate policy and mechanism
   free_node *p = policy_FirstFit(&t_p_page, size);
+  if (p == NULL)
+    return NULL;
   /*
     OSTEP implementation: alloc_header will replace free_node and free_node be moved to the end of user_data_section.
 
@@ -306,24 +719,11 @@ static void *split_alloc(page_t *page, size_t size, int recusive_flag, int tid)
   }
 
   free_node *nfnp = (free_node *)((uintptr_t)up + size);
-  if (p == NULL) {
-    page_t *page_iter = t_p_page;
-    while (page_iter->HDR.nextpage != NULL) {
-      page_iter = (page_t *)page_iter->HDR.nextpage;
-    }
-    // FIXME: DATA RACE ...
-    page_iter->HDR.nextpage = (header_t *)page_alloc(tid);
-    if (page_iter->HDR.nextpage == NULL) {
-      return NULL;
-    }
-
-    return split_alloc((page_t *)page_iter->HDR.nextpage, size, 1, tid);
-  }
 
-  assert((uintptr_t)nfnp + sizeof(free_node) <= (uintptr_t)t_p_page + PAGE_SIZE);
+  assert((uintptr_t)nfnp + sizeof(free_node) <= (uintptr_t)t_p_page + t_p_page->HDR.span);
   memmove(nfnp, p, sizeof(free_node));
   nfnp->len -= (size + sizeof(alloc_header));
-  assert((uintptr_t)t_p_page <= (uintptr_t)nfnp && (uintptr_t)nfnp + nfnp->len <= (uintptr_t)t_p_page + PAGE_SIZE);
+  assert((uintptr_t)t_p_page <= (uintptr_t)nfnp && (uintptr_t)nfnp + nfnp->len <= (uintptr_t)t_p_page + t_p_page->HDR.span);
   assert(nfnp->len >= 0);
 
   // FIXME: ...
@@ -355,69 +755,569 @@ static void *split_alloc(page_t *page, size_t size, int recusive_flag, int tid)
   }
 
   t_p_page->HDR.obj_cnt++;
+  if (t_p_page->HDR.obj_cnt == 1 && t_p_page != chain_of(h, tid, size))
+    h->cpu[tid].cache[chain_slot(size)].nr_empty--;
   *((alloc_header *)p) = (alloc_header){
       .cpu_id = tid,
       .len = size,
       .magic = 0x6d616c63, // m: 6d  a: 61  l:6c  c:63  ==>  mal(lo)c
   };
-  assert(nfnp->len <= PAGE_SIZE);
+  assert(nfnp->len <= t_p_page->HDR.span);
   // printf("page: %p, obj_id: %d, leave critical section :: kalloc size: %ld, kalloc return: %p\n", t_p_page, t_p_page->HDR.obj_cnt - 1, size, up);
   return up;
 }
 
-page_t *cpu_page_list[128];
+static void *split_alloc(kmem_heap *h, page_t *page, size_t size, int recusive_flag, int tid) {
+  void *up = split_alloc_fit(h, page, size, tid);
+  if (up != NULL)
+    return up;
+
+  page_t *page_iter = page;
+  while (page_iter->HDR.nextpage != NULL) {
+    page_iter = (page_t *)page_iter->HDR.nextpage;
+  }
+  // FIXME: DATA RACE ...
+  page_iter->HDR.nextpage = (header_t *)page_alloc(h, tid, page_iter->HDR.span, 0);
+  if (page_iter->HDR.nextpage == NULL) {
+    return NULL;
+  }
+  chain_cache_t *cc = &h->cpu[tid].cache[chain_slot(size)];
+  cc->nr_empty++;
+  cc->grown++;
+  kcache_grow(h, cc, page_iter->HDR.span);
+
+  return split_alloc(h, (page_t *)page_iter->HDR.nextpage, size, 1, tid);
+}
+
+
+/*
+    slot pages (classes up to SMALL_MAX) are cut into equal slots of
+    alloc_header + class size, handed out from `bump` on first. a free slot
+    links to the next one through its first payload word, by offset from the
+    page (0 ends a stack), and sits on one of two stacks:
+
+      local:  popped and pushed by the holder of the chain lock, with plain
+              loads and stores
+      remote: kfree pushes onto it from any thread with one CAS, without
+              the lock. the low half is the top, the high half counts the
+              slots on it; the count tags every push and lets the lock
+              holder settle obj_cnt when it swaps the whole stack out.
+
+    kfree so never takes a chain lock for a small block: the lock is left to
+    kalloc and to changes of a page as a whole, growing a chain or finding
+    pages empty and giving them back (kcache_scavenge).
+
+    kalloc does keep the lock, one uncontended xchg, for the local stack: a
+    tid is not a thread. kalloc_cur() and the preload shim map every thread
+    to the tid of the CPU it runs on and may be preempted or migrate
+    mid-pop, and tests and callers share tids on purpose, so nothing makes
+    the holder of a tid exclusive without the lock (an rseq critical
+    section would, at the price of per-CPU rather than per-tid chains).
+
+    since a small block finds its page without the chain, a slot page can
+    change hands: kthread_exit() detaches the slot chains of an exiting
+    thread's tid and leaves the pages still holding objects on the orphan
+    list of their class. a chain being created or running full adopts one
+    from there before it takes a fresh page from BIGMEM.
+
+    a chain only holds pages that may have a free slot, besides its head: a
+    page slot_alloc() finds dry leaves the chain for the full list of its
+    class (slot_retire), marked with SLOT_FULL on its remote stack. the
+    kfree that finds the mark moves it on to the orphans (slot_unfull), so
+    every orphan has a free slot, and a refill only passes the pages it
+    retires on the way: O(1) amortized, whatever the length of the chain.
+*/
+#define SLOT_TOP(r) ((uint32_t)(r))
+#define SLOT_CNT(r) ((uint32_t)((r) >> 32) & 0x7fffffff)
+#define SLOT_FULL (1ul << 63)
+
+static inline uint32_t *slot_link(page_t *page, uint32_t off) {
+  return (uint32_t *)((uintptr_t)page + off + sizeof(alloc_header));
+}
+
+// objects of a slot page not on either stack; the caller holds the chain
+// lock, so obj_cnt stays put and remote only grows
+static inline int slot_live(page_t *page) {
+  return page->HDR.obj_cnt - SLOT_CNT(__atomic_load_n(&page->HDR.remote, __ATOMIC_ACQUIRE));
+}
+
+// caller holds the chain lock. a slot off the local stack or from the
+// untouched tail, 0 if neither has one. stride and span are the page's,
+// passed in so that they fold where the class is a constant.
+static inline uint32_t slot_take(page_t *page, uint32_t stride, uint32_t span) {
+  header_t *h = &page->HDR;
+  uint32_t off = h->local;
+  if (off != 0)
+    h->local = *slot_link(page, off);
+  else if (h->bump + stride <= span) {
+    off = h->bump;
+    h->bump += stride;
+  }
+  else
+    return 0;
+  h->obj_cnt++;
+  return off;
+}
+
+static inline void *slot_hand_out(page_t *page, uint32_t off, int c, int tid) {
+  *(alloc_header *)((uintptr_t)page + off) = (alloc_header){
+    .cpu_id = tid,
+    .len = class_size[c],
+    .magic = 0x6d616c63,
+    .slot = off / ALIGN_SIZE,
+  };
+  return (void *)((uintptr_t)page + off + sizeof(alloc_header));
+}
+
+// caller holds the chain lock
+static void *slot_pop(page_t *page, int c, int tid) {
+  header_t *h = &page->HDR;
+  if (h->local == 0 && __atomic_load_n(&h->remote, __ATOMIC_RELAXED) != 0) {
+    uint64_t r = __atomic_exchange_n(&h->remote, 0, __ATOMIC_ACQUIRE);
+    h->local = SLOT_TOP(r);
+    h->obj_cnt -= SLOT_CNT(r);
+  }
+  uint32_t off = slot_take(page, h->stride, h->span);
+  return off != 0 ? slot_hand_out(page, off, c, tid) : NULL;
+}
+
+// whether slot_pop() would succeed; the caller owns the page's local stack
+static inline int slot_has_free(page_t *page) {
+  return page->HDR.local != 0 || __atomic_load_n(&page->HDR.remote, __ATOMIC_RELAXED) != 0 ||
+         page->HDR.bump + page->HDR.stride <= page->HDR.span;
+}
+
+static inline int slot_class(page_t *page) {
+  return size_class(page->HDR.stride - sizeof(alloc_header));
+}
+
+// unlinks the first orphan of class c, NULL if there is none
+static page_t *orphan_adopt(kmem_heap *h, int c) {
+  orphan_list_t *ol = &h->orphans[c];
+  if (__atomic_load_n(&ol->list, __ATOMIC_RELAXED) == NULL)
+    return NULL;
+  spin_lock(&(ol->lk));
+  page_t *page = ol->list;
+  if (page != NULL) {
+    __atomic_store_n(&ol->list, (page_t *)page->HDR.nextpage, __ATOMIC_RELAXED);
+    page->HDR.nextpage = NULL;
+    ol->nr--;
+  }
+  spin_unlock(&(ol->lk));
+  return page;
+}
+
+// page has a free slot and is in no chain
+static void orphan_push(kmem_heap *h, page_t *page) {
+  orphan_list_t *ol = &h->orphans[slot_class(page)];
+  spin_lock(&(ol->lk));
+  page->HDR.nextpage = (header_t *)ol->list;
+  __atomic_store_n(&ol->list, page, __ATOMIC_RELAXED);
+  ol->nr++;
+  spin_unlock(&(ol->lk));
+}
+
+// page is in no chain and slot_pop() found it dry (local stack and tail
+// used up), by its former chain's lock holder. moves it to the full list
+// unless a kfree got in first; returns whether it did. the full list's
+// lock is held across the mark, so the kfree that clears it finds the
+// page linked.
+static int slot_retire(kmem_heap *h, page_t *page) {
+  orphan_list_t *fl = &h->full[slot_class(page)];
+  uint64_t r = 0;
+  spin_lock(&(fl->lk));
+  int full = __atomic_compare_exchange_n(&page->HDR.remote, &r, SLOT_FULL, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  if (full) {
+    page->HDR.prevpage = NULL;
+    page->HDR.nextpage = (header_t *)fl->list;
+    if (fl->list != NULL)
+      fl->list->HDR.prevpage = &page->HDR;
+    fl->list = page;
+    fl->nr++;
+  }
+  spin_unlock(&(fl->lk));
+  return full;
+}
+
+// the first kfree into a retired page hands it on to the orphans
+static void slot_unfull(kmem_heap *h, page_t *page) {
+  orphan_list_t *fl = &h->full[slot_class(page)];
+  spin_lock(&(fl->lk));
+  if (page->HDR.prevpage != NULL)
+    page->HDR.prevpage->nextpage = page->HDR.nextpage;
+  else
+    fl->list = (page_t *)page->HDR.nextpage;
+  if (page->HDR.nextpage != NULL)
+    page->HDR.nextpage->prevpage = page->HDR.prevpage;
+  fl->nr--;
+  spin_unlock(&(fl->lk));
+  orphan_push(h, page);
+}
+
+// a page in no chain any more, with live objects
+static void slot_park(kmem_heap *h, page_t *page) {
+  if (slot_has_free(page) || !slot_retire(h, page))
+    orphan_push(h, page);
+}
+
+// caller holds head->HDR.lock. tries where the last allocation left off,
+// then the head, then the pages behind it, retiring the dry ones it meets;
+// a chain without a free slot grows by an orphan or a fresh page right
+// behind the head.
+static void *slot_alloc(kmem_heap *h, page_t *head, int c, int tid) {
+  chain_cache_t *cc = &h->cpu[tid].cache[c];
+  void *p = cc->cur != NULL ? slot_pop(cc->cur, c, tid) : NULL;
+  if (p != NULL)
+    return p;
+  page_t *page = head, *next;
+  while (page != NULL) {
+    p = slot_pop(page, c, tid);
+    if (p != NULL) {
+      cc->cur = page;
+      return p;
+    }
+    next = (page_t *)page->HDR.nextpage;
+    // a kfree that beat the retirement left a slot: try again
+    if (page != head && slot_retire(h, page)) {
+      head->HDR.nextpage = (header_t *)next;
+      if (cc->cur == page)
+        cc->cur = NULL;
+      page = next;
+    }
+    else if (page == head)
+      page = next;
+  }
+  page = orphan_adopt(h, c);
+  if (page == NULL)
+    page = page_alloc(h, tid, head->HDR.span, head->HDR.stride);
+  if (page == NULL)
+    return NULL;
+  page->HDR.nextpage = head->HDR.nextpage;
+  head->HDR.nextpage = (header_t *)page;
+  cc->grown++;
+  kcache_grow(h, cc, head->HDR.span);
+  cc->cur = page;
+  return slot_pop(page, c, tid);
+}
+
+// from any thread, without a lock but for the rare first kfree into a
+// retired page. h is the heap of the block.
+static void slot_free(kmem_heap *h, void *ptr) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+  assert(ah->magic == 0x6d616c63);
+  uint32_t off = ah->slot * ALIGN_SIZE;
+  page_t *page = (page_t *)((uintptr_t)ah - off);
+  uint64_t r = __atomic_load_n(&page->HDR.remote, __ATOMIC_RELAXED);
+  do
+    *slot_link(page, off) = SLOT_TOP(r);
+  while (!__atomic_compare_exchange_n(&page->HDR.remote, &r,
+                                      (uint64_t)(SLOT_CNT(r) + 1) << 32 | off,
+                                      1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (r & SLOT_FULL)
+    slot_unfull(h, page);
+}
+
+// caller holds head->HDR.lock, ptr was allocated from head's chain
+static void chain_free(kmem_heap *h, page_t *head, void *ptr) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+  chain_cache_t *cc = &h->cpu[ah->cpu_id].cache[chain_slot(ah->len)];
+  page_t *tmp_p = head;
+  while (tmp_p != NULL) {
+    if ((uintptr_t)tmp_p <= (uintptr_t)ptr && (uintptr_t)ptr < (uintptr_t)tmp_p + tmp_p->HDR.span) {
+      break;
+    }
+    tmp_p = (page_t *)(tmp_p->HDR.nextpage);
+  }
+  if (tmp_p == NULL) {
+    printf("abnormal free, ptr hasn't been allocated.\n");
+    assert(0);
+  }
+  coalescing_free(tmp_p, ptr);
+  if (tmp_p->HDR.obj_cnt == 0 && tmp_p != head)
+    cc->nr_empty++;
+}
 
-#define CPU_NUM 4
 typedef struct {
   size_t small_malloc_sz;
   size_t big_malloc_sz;
   size_t page_num;
+  size_t page_bytes;    // taken from BIGMEM for pages and spans
+  size_t page_capacity; // of those, usable for objects
+  size_t small_free_nodes;
+  size_t big_free_nodes;
+  size_t big_obj_cnt;   // blocks taken from BIGMEM, pages included
+  size_t orphan_pages;  // of page_num, in no chain
 } mem_stat;
 
-#ifdef TEST
-static mem_stat *memory_stat() {
-  mem_stat *ms = (mem_stat *)malloc(sizeof(mem_stat));
+// a slot page's share of ms: its free slots, with the headers of the live
+// ones as for free lists
+static void slot_page_stat(mem_stat *ms, page_t *page) {
+  size_t slots = (page->HDR.span - HDR_SIZE) / page->HDR.stride;
+  int live = slot_live(page);
+  ms->page_num++;
+  ms->page_bytes += BIG_SIZE(page->HDR.span);
+  ms->page_capacity += slots * page->HDR.stride;
+  ms->small_malloc_sz += (slots - live) * page->HDR.stride + live * sizeof(alloc_header);
+}
+
+// does not allocate, so it may run under pmm_lock_all() in the preload shim
+static void memory_stat_fill(kmem_heap *h, mem_stat *ms) {
   *ms = (mem_stat) {
     .page_num = 0,
     .small_malloc_sz = 0,
     .big_malloc_sz = 0,
+    .page_bytes = 0,
+    .page_capacity = 0,
+    .small_free_nodes = 0,
+    .big_free_nodes = 0,
+    .big_obj_cnt = 0,
+    .orphan_pages = 0,
   };
 
   int malloc_n = 0;
   free_node *fnode_p = NULL;
 
   page_t *page_p = NULL;
-  for (int i = 0; i < CPU_NUM; i++) {
-    page_p = cpu_page_list[i];
+  for (int i = 0; i < CPU_NUM * NR_CHAINS; i++) {
+    page_p = h->cpu[i % CPU_NUM].chain[i / CPU_NUM];
     while (page_p != NULL) {
-      malloc_n += page_p->HDR.obj_cnt;
+      if (page_p->HDR.stride) {
+        slot_page_stat(ms, page_p);
+        page_p = (page_t *)(page_p->HDR.nextpage);
+        continue;
+      }
       ms->page_num ++;
+      ms->page_bytes += BIG_SIZE(page_p->HDR.span);
+      malloc_n += page_p->HDR.obj_cnt;
+      ms->page_capacity += page_p->HDR.span - HDR_SIZE;
       fnode_p = page_p->HDR.freelist.head;
       while (fnode_p != NULL) {
         ms->small_malloc_sz += fnode_p->len;
+        ms->small_free_nodes ++;
         fnode_p = fnode_p->next;
       }
       page_p = (page_t *)(page_p->HDR.nextpage);
     }
   }
   ms->small_malloc_sz += malloc_n * sizeof(alloc_header);
+  for (int c = 0; c < FIRST_MID_CLASS; c++)
+    for (int full = 0; full < 2; full++)
+      for (page_p = (full ? h->full : h->orphans)[c].list; page_p != NULL; page_p = (page_t *)page_p->HDR.nextpage) {
+        slot_page_stat(ms, page_p);
+        ms->orphan_pages++;
+      }
+#ifdef LAZY_COALESCE
+  // quick listed blocks still count in their page's obj_cnt
+  for (int i = 0; i < CPU_NUM; i++)
+    for (int c = 0; c < NR_CLASSES; c++)
+      ms->small_malloc_sz += (size_t)h->cpu[i].nr_quick[c] * class_size[c];
+#endif
 
-  fnode_p = Mem_freenode_head.addr;
-  while (fnode_p != NULL) {
-    ms->big_malloc_sz += fnode_p->len;
-    fnode_p = fnode_p->next;
+  for (int i = 0; i < h->nr_shards; i++) {
+    fnode_p = h->shard[i].addr;
+    while (fnode_p != NULL) {
+      ms->big_malloc_sz += fnode_p->len;
+      ms->big_free_nodes ++;
+      fnode_p = fnode_p->next;
+    }
+    ms->big_obj_cnt += h->shard[i].obj_cnt;
   }
-  ms->big_malloc_sz += Mem_freenode_head.obj_cnt * sizeof(alloc_header);
+  ms->big_malloc_sz += ms->big_obj_cnt * sizeof(alloc_header);
+  // cached blocks are free, yet still counted in obj_cnt
+  for (int i = 0; i < CPU_NUM; i++)
+    ms->big_malloc_sz += h->lcache[i].bytes;
+}
+
+// of the default heap
+static mem_stat *memory_stat() {
+  mem_stat *ms = (mem_stat *)malloc(sizeof(mem_stat));
+  memory_stat_fill(&kmem_default, ms);
   return ms;
 }
-#endif
 
 void pmm_init();
+void pmm_init_area(void *start, size_t size);
+// sets h up on [start, start + size), as pmm_init_area() does kmem_default
+void pmm_init_heap(kmem_heap *h, void *start, size_t size);
+// a heap of its own, mapped with its kmem_heap in front of a size byte
+// area; NULL when the mapping fails. pmm_destroy() unmaps it whole, blocks
+// still allocated from it included. see kmem_heap.
+kmem_heap *pmm_create(size_t size);
+void pmm_destroy(kmem_heap *h);
+// kalloc/kzalloc/kfree on h. a block goes back to the heap it came from;
+// tids, as with kalloc, pick one of h's per-CPU chains and caches
+void *kalloc_heap(kmem_heap *h, int tid, size_t size);
+void *kzalloc_heap(kmem_heap *h, int tid, size_t size);
+void kfree_heap(kmem_heap *h, int tid, void *ptr);
+// every allocator lock, in the order kalloc nests them: for consistent
+// snapshots and for fork()
+void pmm_lock_all();
+void pmm_unlock_all();
 void *kalloc(int tid, size_t size);
 void kfree(int tid, void *ptr);
+// kfree of a block kalloc(tid', size) returned, for callers that keep the
+// size anyway (C++ sized deallocation, see cxx/kma.hpp)
+void kfree_sized(int tid, void *ptr, size_t size);
+// zeroed kalloc. kcalloc returns NULL when n * size overflows.
+void *kzalloc(int tid, size_t size);
+void *kcalloc(int tid, size_t n, size_t size);
+// a thread that kallocs with a tid of its own calls kthread_attach(tid)
+// once; when it exits, kthread_exit(tid) runs from a pthread key
+// destructor. that takes tid offline (kepoch_offline), gives its large
+// block cache and empty pages back to BIGMEM and orphans its slot pages
+// still holding objects, for other chains to adopt. no other thread may
+// allocate with tid meanwhile (kalloc_cur users share tids, so not for them).
+// kfree_orphans() gives back orphans emptied by remote frees since.
+int kthread_attach(int tid);
+void kthread_exit(int tid);
+void kfree_orphans();
+
+// allocation event trace (trace.c), built with -DKTRACE. see there for the
+// file format; ktrace_replay() runs a trace file against this heap.
+enum { KT_ALLOC = 1, KT_ZALLOC, KT_FREE, KT_FREE_DEFERRED };
+#define KTRACE_BIG 0xff // cls of blocks above MID_MAX
+#define KTRACE_VERSION 1
 
 typedef struct {
-  void *start, *end;
-} Area;
+  uint64_t ts;       // TSC
+  uint64_t ptr;
+  uint32_t size;     // asked for by an allocation, held by a freed block
+  uint8_t op;
+  uint8_t cls;       // size class of size
+  int16_t owner;     // the block's alloc_header.cpu_id: -1 for BIGMEM
+  int16_t cpu;       // tid of the call, the freeing one for frees
+  uint16_t reserved[3];
+} ktrace_event;
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t cpu_num;
+  uint32_t reserved;
+  uint64_t ts0, ns0; // TSC and CLOCK_MONOTONIC at ktrace_start()
+  uint64_t ts1, ns1; // and at ktrace_stop()
+  uint64_t events;   // ktrace_events following the header
+  uint64_t dropped;  // lost to full rings
+} ktrace_file_header;
+
+typedef struct {
+  uint64_t events;
+  uint64_t dropped;
+} ktrace_stat;
+
+#ifdef KTRACE
+extern int ktrace_on;
+void ktrace_emit(int op, int tid, void *ptr, size_t size);
+int ktrace_start(const char *path);
+int ktrace_stop(ktrace_stat *st);
+long ktrace_replay(const char *path, long *unmatched);
+#define ktrace_active() __builtin_expect(__atomic_load_n(&ktrace_on, __ATOMIC_RELAXED), 0)
+#define KTRACE_EMIT(op, tid, ptr, size)        \
+  do {                                         \
+    if (ktrace_active())                       \
+      ktrace_emit((op), (tid), (ptr), (size)); \
+  } while (0)
+#else
+#define ktrace_active() 0
+#define KTRACE_EMIT(op, tid, ptr, size) ((void)0)
+#endif
 
-static Area heap = {};
\ No newline at end of file
+/*
+    inline fast path: kalloc_inline(tid, sizeof(struct foo)) with a size
+    known at compile time folds the class, its slot stride and span
+    (class_size, span_pages, PAGE_SIZE) into constants and takes a slot of
+    the page the chain last allocated from right here, from its local stack
+    or its untouched tail. what it saves is the call, not the chain lock:
+    the pop still takes it, as kalloc does, since a tid may be shared by
+    several threads (see the slot pages above). everything else is a miss and goes to kalloc: a
+    size only known at run time or above SMALL_MAX, a chain not created
+    yet, a page with only remote frees left, a scavenge falling due, a
+    running trace, and every call of a HEAP_PROFILE build, whose sampling
+    lives in kalloc. kfree_inline hands small blocks to slot_free directly.
+*/
+static inline __attribute__((always_inline)) void *kalloc_inline(int tid, size_t size) {
+#ifndef HEAP_PROFILE
+  if (__builtin_constant_p(size) && size <= SMALL_MAX && !ktrace_active()) {
+    const int c = size_class(size);
+    cpu_pages_t *cp = &kmem_default.cpu[tid];
+    page_t *head = __atomic_load_n(&cp->chain[c], __ATOMIC_ACQUIRE);
+    if (head != NULL) {
+      spin_lock(&(head->HDR.lock));
+      page_t *page = cp->cache[c].cur;
+      uint32_t t = __atomic_load_n(&cp->ticks, __ATOMIC_RELAXED) + 1;
+      uint32_t off = 0;
+      if (page != NULL && t != KCACHE_PERIOD)
+        off = slot_take(page, class_size[c] + sizeof(alloc_header), span_pages[c] * PAGE_SIZE);
+      if (off != 0) {
+        cp->cache[c].ops++;
+        __atomic_store_n(&cp->ticks, t, __ATOMIC_RELAXED);
+      }
+      spin_unlock(&(head->HDR.lock));
+      if (off != 0)
+        return slot_hand_out(page, off, c, tid);
+    }
+  }
+#endif
+  return kalloc(tid, size);
+}
+
+static inline __attribute__((always_inline)) void kfree_inline(int tid, void *ptr) {
+  alloc_header *ah = ptr - sizeof(alloc_header);
+#ifdef HEAP_PROFILE
+  if (ah->slot != 0 && !ah->sampled && !ktrace_active())
+#else
+  if (ah->slot != 0 && !ktrace_active())
+#endif
+    slot_free(&kmem_default, ptr);
+  else
+    kfree(tid, ptr);
+}
+
+// epoch based deferred free (defer.c). a block passed to kfree_deferred()
+// goes back to the heap once every online tid has announced a quiescent
+// state, i.e. holds no reference obtained before the call. tids start
+// offline; a tid must be online while it dereferences shared blocks.
+void kfree_deferred(int tid, void *ptr);
+void kepoch_online(int tid);
+void kepoch_quiescent(int tid);
+void kepoch_offline(int tid);
+// frees the ready batches of every tid, for the background scavenger
+void kepoch_reclaim_all();
+// file backed heap (persist.c), used instead of pmm_init(). pmm_open()
+// returns 1 when it restored the heap of a previous run, 0 for a new one.
+int pmm_open(const char *path, size_t size);
+void pmm_sync();
+void pmm_close();
+void kheap_set_root(void *p);
+void *kheap_root();
+// background scavenger (scavenger.c): one round every period_ms, taking at
+// most budget percent of a CPU. kalloc leaves scavenging to it meanwhile.
+// kscav_stat() copies the statistics of the latest round, 0 before the
+// first one.
+extern int kscav_on;
+int kscav_start(unsigned period_ms, unsigned budget);
+void kscav_stop();
+int kscav_stat(mem_stat *ms);
+
+#ifdef HEAP_PROFILE
+// sampling heap profiler (heapprof.c). kalloc charges every allocation to
+// prof_bytes_left and records the one that drives it below zero.
+// the functions between a caller and prof_sample() live in their own
+// section, so a sampled stack can start at the first frame outside it
+// however much the compiler inlined.
+#define PROF_TEXT __attribute__((section("kma_prof_text")))
+extern __thread long prof_bytes_left;
+void prof_sample(void *ptr, size_t size);
+void prof_forget(void *ptr);
+void kprof_set_rate(size_t bytes);
+int kprof_dump(int fd);
+#else
+#define PROF_TEXT
+#endif
+// same as kalloc/kfree, on the heap of the CPU the caller currently runs on
+int cpu_raw();
+int cpu_current();
+void *kalloc_cur(size_t size);
+void kfree_cur(void *ptr);
@@ -0,0 +1,187 @@
+/*
+    libc compatible entry points over kalloc/kfree
+
+      make preload
+      LD_PRELOAD=build/libkma.so <program>
+
+    every call goes to the heap of the CPU the thread currently runs on (see
+    cpu_current() in pmm.c). the heap is mmap()ed and set up by pmm_init_area() on
+    the first call, so nothing here depends on constructors having run or on
+    another malloc being available.
+
+    blocks returned by posix_memalign & co. with an alignment above
+    ALIGN_SIZE live inside a bigger kalloc block; a fake alloc_header with
+    ALIGNED_MAGIC right before the returned pointer records the distance back
+    to the real one.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "../pmm.h"
+
+#define EXPORT __attribute__((visibility("default")))
+#define ALLOC_MAGIC 0x6d616c63
+#define ALIGNED_MAGIC 0x616c676e // a: 61  l: 6c  g: 67  n: 6e  ==>  align
+
+static spinlock_t init_lk = (spinlock_t) {.locked = 0};
+static volatile int initialized;
+static char *heap_lo, *heap_hi;
+
+
+static void preload_init() {
+  int first = 0;
+  spin_lock(&init_lk);
+  if (!initialized) {
+    void *p = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+      abort();
+    pmm_init_area((char *)p + CACHELINE_SIZE - sizeof(alloc_header), HEAP_SIZE - CACHELINE_SIZE);
+    heap_lo = p;
+    heap_hi = (char *)p + HEAP_SIZE;
+    __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+    first = 1;
+  }
+  spin_unlock(&init_lk);
+  // may allocate, so only once malloc works
+  if (first)
+    // a child forked while another thread sat inside kalloc must not
+    // inherit a held lock
+    pthread_atfork(pmm_lock_all, pmm_unlock_all, pmm_unlock_all);
+}
+
+static inline int cpu_self() {
+  if (__builtin_expect(!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE), 0))
+    preload_init();
+  return cpu_current();
+}
+
+static inline int owned(void *ptr) {
+  return (char *)ptr >= heap_lo && (char *)ptr < heap_hi;
+}
+
+static inline alloc_header *header_of(void *ptr) {
+  return (alloc_header *)((uintptr_t)ptr - sizeof(alloc_header));
+}
+
+// the pointer kalloc returned for a (possibly over-aligned) user pointer
+static inline void *base_of(void *ptr) {
+  alloc_header *ah = header_of(ptr);
+  if (ah->magic == ALIGNED_MAGIC)
+    return (void *)((uintptr_t)ptr - ah->len);
+  return ptr;
+}
+
+static void *do_malloc(size_t size) {
+  if (size > HEAP_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *p = kalloc(cpu_self(), size);
+  if (p == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+static void *do_memalign(size_t align, size_t size) {
+  if (align <= ALIGN_SIZE)
+    return do_malloc(size);
+  if (size > HEAP_SIZE || align > HEAP_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *p = do_malloc(size + align);
+  if (p == NULL)
+    return NULL;
+  uintptr_t up = ROUNDUP((uintptr_t)p + sizeof(alloc_header), align);
+  *header_of((void *)up) = (alloc_header) {
+    .cpu_id = header_of(p)->cpu_id,
+    .len = up - (uintptr_t)p,
+    .magic = ALIGNED_MAGIC,
+  };
+  return (void *)up;
+}
+
+static size_t usable_size(void *ptr) {
+  void *base = base_of(ptr);
+  return header_of(base)->len - ((uintptr_t)ptr - (uintptr_t)base);
+}
+
+EXPORT void *malloc(size_t size) {
+  return do_malloc(size);
+}
+
+EXPORT void free(void *ptr) {
+  // memory handed out before we were loaded (e.g. by the dynamic linker)
+  // is not ours to take back
+  if (ptr == NULL || !owned(ptr))
+    return;
+  void *base = base_of(ptr);
+  assert(header_of(base)->magic == ALLOC_MAGIC);
+  kfree(cpu_self(), base);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total) || total > HEAP_SIZE) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  // skips clearing what is known to be zero already
+  void *p = kzalloc(cpu_self(), total);
+  if (p == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return do_malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  // a foreign block's size is unknown: they only come from the dynamic
+  // linker's bootstrap allocator, which never hands them to realloc
+  assert(owned(ptr));
+  size_t old = usable_size(ptr);
+  if (size <= old)
+    return ptr;
+  void *p = do_malloc(size);
+  if (p == NULL)
+    return NULL;
+  memcpy(p, ptr, old);
+  free(ptr);
+  return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size) {
+  if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+    return EINVAL;
+  void *p = do_memalign(align, size);
+  if (p == NULL)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size) {
+  if (align == 0 || (align & (align - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return do_memalign(align, size);
+}
+
+EXPORT void *memalign(size_t align, size_t size) {
+  return aligned_alloc(align, size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+  if (ptr == NULL || !owned(ptr))
+    return 0;
+  return usable_size(ptr);
+}
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pmm.h"
+
+/*
+    background scavenger
+
+    kscav_start() moves reclamation off kalloc/kfree onto a thread of its
+    own. every period_ms it runs a round:
+
+      - kcache_scavenge() on every CPU, trimming the page chains down to
+        what they keep; kalloc stops doing so inline while the thread runs
+      - kepoch_reclaim_all(): the ready deferred batches of every tid go
+        back to their chains, sorted
+      - kfree_orphans(): slot pages left by exited threads that remote
+        frees have emptied since go back to BIGMEM
+      - the pages inside the free ranges of a BIGMEM shard that saw no
+        allocation or free for KSCAV_IDLE rounds go back to the OS with
+        madvise(MADV_DONTNEED). they read as zero from then on, so the
+        free_node is marked clean and kzalloc skips clearing them.
+      - the mem_stat snapshot kscav_stat() hands out is refreshed
+
+    a round that took w of CPU time is followed by a wait of at least
+    w * (100 - budget) / budget, so the thread stays within budget percent
+    of a CPU however long rounds get. kscav_stop() wakes it up and joins.
+*/
+
+#define KSCAV_IDLE 4
+// smaller free ranges are not worth a syscall
+#define KSCAV_RELEASE_MIN (64 * 1024)
+
+int kscav_on;
+
+static pthread_t scav_thread;
+static pthread_mutex_t scav_lk = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scav_wake;
+static int scav_stopping;
+static unsigned scav_period_ms, scav_budget;
+
+static mem_stat scav_snapshot;
+static int scav_rounds;
+
+static uint32_t shard_ops[MAX_SHARDS];
+static int shard_idle[MAX_SHARDS];
+
+// caller holds sh->lk. drops the pages inside each free range that may
+// hold data, keeping the free_node in front; returns the bytes dropped
+static size_t release_shard(freenode_head_t *sh, uintptr_t os_page) {
+  size_t released = 0;
+  for (free_node *fp = sh->addr; fp != NULL; fp = fp->next) {
+    uintptr_t a = (uintptr_t)fp;
+    uintptr_t lo = ROUNDUP(a + sizeof(free_node), os_page);
+    uintptr_t hi = (a + fp->len) & ~(os_page - 1);
+    uintptr_t dirty_end = a + (fp->dirty < fp->len ? fp->dirty : fp->len);
+    if (dirty_end <= lo || hi < lo + KSCAV_RELEASE_MIN)
+      continue;
+    if (madvise((void *)lo, hi - lo, MADV_DONTNEED) != 0)
+      continue;
+    // the tail behind the last whole page is cleared by hand
+    if (dirty_end > hi)
+      memset((void *)hi, 0, dirty_end - hi);
+    fp->dirty = lo - a;
+    released += hi - lo;
+  }
+  return released;
+}
+
+static void release_idle_shards() {
+  uintptr_t os_page = sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < kmem_default.nr_shards; i++) {
+    freenode_head_t *sh = &kmem_default.shard[i];
+    spin_lock(&(sh->lk));
+    if (sh->ops != shard_ops[i]) {
+      shard_ops[i] = sh->ops;
+      shard_idle[i] = 0;
+    }
+    // released once per idle stretch; a range dropped already is clean
+    else if (++shard_idle[i] == KSCAV_IDLE)
+      release_shard(sh, os_page);
+    spin_unlock(&(sh->lk));
+  }
+}
+
+static void scav_round() {
+  for (int i = 0; i < CPU_NUM; i++)
+    kcache_scavenge(i);
+  kepoch_reclaim_all();
+  kfree_orphans();
+  if (kmem_default.madvise)
+    release_idle_shards();
+  mem_stat ms;
+  pmm_lock_all();
+  memory_stat_fill(&kmem_default, &ms);
+  pmm_unlock_all();
+  pthread_mutex_lock(&scav_lk);
+  scav_snapshot = ms;
+  scav_rounds++;
+  pthread_mutex_unlock(&scav_lk);
+}
+
+static uint64_t ns_of(struct timespec *t) {
+  return (uint64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+static void *scav_main(void *arg) {
+  pthread_mutex_lock(&scav_lk);
+  while (!scav_stopping) {
+    pthread_mutex_unlock(&scav_lk);
+    struct timespec t0, t1, until;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    scav_round();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    uint64_t work = ns_of(&t1) - ns_of(&t0);
+    uint64_t wait = (uint64_t)scav_period_ms * 1000000;
+    if (work * (100 - scav_budget) / scav_budget > wait)
+      wait = work * (100 - scav_budget) / scav_budget;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    uint64_t end = ns_of(&until) + wait;
+    until = (struct timespec) {.tv_sec = end / 1000000000, .tv_nsec = end % 1000000000};
+    pthread_mutex_lock(&scav_lk);
+    while (!scav_stopping && pthread_cond_timedwait(&scav_wake, &scav_lk, &until) == 0)
+      ;
+  }
+  pthread_mutex_unlock(&scav_lk);
+  return NULL;
+}
+
+// 0 on success, -1 when it runs already or the thread cannot be created
+int kscav_start(unsigned period_ms, unsigned budget) {
+  assert(budget > 0 && budget <= 100);
+  if (kscav_on)
+    return -1;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&scav_wake, &attr);
+  pthread_condattr_destroy(&attr);
+  scav_period_ms = period_ms;
+  scav_budget = budget;
+  scav_stopping = 0;
+  // a restarted scavenger reports its own rounds only
+  pthread_mutex_lock(&scav_lk);
+  scav_rounds = 0;
+  memset(&scav_snapshot, 0, sizeof(scav_snapshot));
+  pthread_mutex_unlock(&scav_lk);
+  memset(shard_ops, 0, sizeof(shard_ops));
+  memset(shard_idle, 0, sizeof(shard_idle));
+  if (pthread_create(&scav_thread, NULL, scav_main, NULL) != 0)
+    return -1;
+  __atomic_store_n(&kscav_on, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// returns once the thread is gone; kalloc scavenges inline again
+void kscav_stop() {
+  if (!kscav_on)
+    return;
+  pthread_mutex_lock(&scav_lk);
+  scav_stopping = 1;
+  pthread_cond_signal(&scav_wake);
+  pthread_mutex_unlock(&scav_lk);
+  pthread_join(scav_thread, NULL);
+  pthread_cond_destroy(&scav_wake);
+  __atomic_store_n(&kscav_on, 0, __ATOMIC_RELAXED);
+}
+
+int kscav_stat(mem_stat *ms) {
+  pthread_mutex_lock(&scav_lk);
+  int rounds = scav_rounds;
+  if (rounds > 0)
+    *ms = scav_snapshot;
+  pthread_mutex_unlock(&scav_lk);
+  return rounds > 0;
+}
@@ -1,25 +1,123 @@
 #include <stdint.h>
+#include <stdio.h>
 
+/*
+    -DLOCK_STAT: every lock belongs to a lock class (spin_set_class) and
+    each CPU counts, per class, acquisitions, acquisitions that had to wait,
+    the cycles spent waiting and the longest hold. a CPU only writes its own
+    row of lock_stats, picked by its kernel CPU number (cpu_raw(), not the
+    heap index cpu_current() folds to CPU_NUM), so the counting adds no
+    shared cache line; an update interrupted by a migration may get lost,
+    which a profile can afford. CPUs numbered LOCK_STAT_CPUS and up share
+    the last row: build with a bigger LOCK_STAT_CPUS for such machines.
+    lock_stat_dump() (lockstat.c) sums the rows up.
+*/
+
+#ifdef LOCK_STAT
+enum {
+  LK_OTHER = 0,
+  LK_CHAIN,  // per-CPU small object chains
+  LK_MID,    // per-CPU mid size span chains
+  LK_BIGMEM, // BIGMEM shards
+  LK_DEFER,  // deferred free batches
+  LK_ORPHAN, // slot pages of exited threads
+  NR_LOCK_CLASSES,
+};
+
+#ifndef LOCK_STAT_CPUS
+#define LOCK_STAT_CPUS 128
+#endif
+
+typedef struct {
+  uint64_t acquired;
+  uint64_t contended;
+  uint64_t spin_cycles;
+  uint64_t hold_cycles;
+  uint64_t max_hold;
+} lock_stat_t;
+
+typedef struct {
+  lock_stat_t cls[NR_LOCK_CLASSES];
+} __attribute__((aligned(64))) lock_stat_cpu_t;
+
+extern lock_stat_cpu_t lock_stats[LOCK_STAT_CPUS];
+int cpu_raw();
+
+static inline lock_stat_cpu_t *lock_stat_row() {
+  int cpu = cpu_raw();
+  return &lock_stats[cpu < LOCK_STAT_CPUS ? cpu : LOCK_STAT_CPUS - 1];
+}
+void lock_stat_dump(FILE *f);
+#endif
+
+// a lock xchg on x86. unlike inline asm the builtin is seen by
+// -fsanitize=thread, which so knows the locks order what they guard
 static inline intptr_t atomic_xchg_(volatile intptr_t *addr,
                                intptr_t newval) {
-  intptr_t result;
-  asm volatile ("lock xchg %0, %1":
-    "+m"(*addr), "=a"(result) : "1"(newval) : "cc");
-  return result;
+  return __atomic_exchange_n(addr, newval, __ATOMIC_SEQ_CST);
 }
 
 typedef struct spinlock {
   intptr_t locked;
+#ifdef LOCK_STAT
+  int cls;
+  uint64_t since; // when the holder got it
+#endif
 } spinlock_t;
 
 static void spin_init(spinlock_t *lk) {
   lk->locked = 0;
 }
 
+#ifdef LOCK_STAT
+#define SPINLOCK_INIT(c) { .locked = 0, .cls = (c) }
+#define spin_set_class(lk, c) ((lk)->cls = (c))
+#else
+#define SPINLOCK_INIT(c) { .locked = 0 }
+#define spin_set_class(lk, c) ((void)(lk))
+#endif
+
 static void spin_lock(spinlock_t *lk) {
-  while (atomic_xchg_(&lk->locked, 1)) ;
+#ifdef LOCK_STAT
+  if (!atomic_xchg_(&lk->locked, 1)) {
+    lk->since = __builtin_ia32_rdtsc();
+    lock_stat_row()->cls[lk->cls].acquired++;
+    return;
+  }
+  uint64_t t0 = __builtin_ia32_rdtsc();
+#endif
+  while (atomic_xchg_(&lk->locked, 1))
+    // wait with plain loads, the line stays shared instead of bouncing
+    while (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED))
+      __builtin_ia32_pause();
+#ifdef LOCK_STAT
+  lk->since = __builtin_ia32_rdtsc();
+  lock_stat_t *st = &lock_stat_row()->cls[lk->cls];
+  st->acquired++;
+  st->contended++;
+  st->spin_cycles += lk->since - t0;
+#endif
+}
+
+// takes the lock only if nobody holds it, returns whether it did. a failed
+// try is not counted as contention: the caller goes elsewhere instead.
+static int spin_trylock(spinlock_t *lk) {
+  if (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) || atomic_xchg_(&lk->locked, 1))
+    return 0;
+#ifdef LOCK_STAT
+  lk->since = __builtin_ia32_rdtsc();
+  lock_stat_row()->cls[lk->cls].acquired++;
+#endif
+  return 1;
 }
 
 static void spin_unlock(spinlock_t *lk) {
+#ifdef LOCK_STAT
+  uint64_t held = __builtin_ia32_rdtsc() - lk->since;
+  lock_stat_t *st = &lock_stat_row()->cls[lk->cls];
+  st->hold_cycles += held;
+  if (held > st->max_hold)
+    st->max_hold = held;
+#endif
   atomic_xchg_(&lk->locked, 0);
 }
@@ -3,6 +3,10 @@
       -DBKL:  enable big_kernel_lk
       -DDEBUG: enable runtime check and stat output ...
       -DTEST: when compile in native (not in Qemu) ...
+      -DLAZY_COALESCE: defer coalescing to per-CPU quick lists (make coalesce)
+      -DHEAP_PROFILE: sample allocations, dump to build/heap.prof (make heapprof)
+      -DLOCK_STAT: count acquisitions and contention per lock class (make lockstat)
+      -DKTRACE: binary allocation event trace, mode 20 (make trace)
     
     compile and run in Qemu: make run ARCH=x86_64-qemu smp=4
 */
@@ -12,8 +16,14 @@
 #include "pmm.h"
 #include <time.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bench/counters.h"
 
+#ifndef PAGE_SIZE
 #define PAGE_SIZE 8192
+#endif
 #define CPU_NUM 4
 
 #define stat_interval 4096
@@ -30,6 +40,15 @@ static void entry(int tid)
 
 static void goodbye()
 {
+#ifdef HEAP_PROFILE
+  int fd = open("build/heap.prof", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || kprof_dump(fd) != 0)
+    printf("heap profile not written\n");
+  close(fd);
+#endif
+#ifdef LOCK_STAT
+  lock_stat_dump(stdout);
+#endif
   printf("End.\n");
 }
 
@@ -114,21 +133,8 @@ size_t test_stat() {
   size_t used_sz = 0;
   for (int i = 0; i < CPU_NUM; i++) {
     for (int j = 0; j < malloc_num[i]; j++) {
-      if (malloc_pool[i][j]->type == OP_ALLOC) {
-        int k = 0;
-        for (; k < 32; k++)
-          if (malloc_pool[i][j]->sz <= (2 << k))
-            break;
-        size_t sz_ = 2 << k;
-        if (sz_ + sizeof(alloc_header) < sizeof(free_node))
-        {
-          sz_ = sizeof(free_node) - sizeof(alloc_header);
-        }
-        if (sz_ < PAGE_SIZE)
-          used_sz += sz_;
-        else
-          used_sz += malloc_pool[i][j]->sz;
-      }
+      if (malloc_pool[i][j]->type == OP_ALLOC)
+        used_sz += kalloc_size(malloc_pool[i][j]->sz);
     }
   }
   return used_sz;
@@ -136,25 +142,21 @@ size_t test_stat() {
 
 void stat_output(int i) {
   if (i % stat_interval == 0) {
-    for (int i = 0; i < CPU_NUM; i++) {
+    for (int i = 0; i < CPU_NUM; i++)
       spin_lock(&(lk[i]));
-      spin_lock(&(cpu_page_list[i]->HDR.lock));
-    }
-    spin_lock(&(Mem_freenode_head.lk));
+    pmm_lock_all();
     mem_stat *mp = NULL;
     double test_used = test_stat() / 1024.0 / 1024.0;
     printf("[TEST] used_sz = %8f MB\n", test_used);
     mp = memory_stat();
-    double real_small_used = (mp->page_num * (PAGE_SIZE - sizeof(header_t)) - mp->small_malloc_sz) / 1024.0 / 1024.0;
-    double real_big_used = (HEAP_SIZE - mp->page_num * PAGE_SIZE - mp->big_malloc_sz) / 1024.0 / 1024.0;
+    double real_small_used = (mp->page_capacity - mp->small_malloc_sz) / 1024.0 / 1024.0;
+    double real_big_used = (HEAP_SIZE - mp->page_bytes - mp->big_malloc_sz) / 1024.0 / 1024.0;
     assert(test_used == real_small_used + real_big_used);
     printf("[REAL] used_sz = %8f MB\n", real_small_used + real_big_used);
 
-    for (int i = 0; i < CPU_NUM; i++) {
+    pmm_unlock_all();
+    for (int i = 0; i < CPU_NUM; i++)
       spin_unlock(&(lk[i]));
-      spin_unlock(&(cpu_page_list[i]->HDR.lock));
-    }
-    spin_unlock(&(Mem_freenode_head.lk));
   }
 }
 
@@ -285,16 +287,8 @@ void restrict_test_body(int tid) {
     {
       op->addr = kalloc(tid - 1, op->sz);
       *(uintptr_t *)(op->addr) = (uintptr_t)(op->addr);
-      int j = 0;
-      for (; j < 32; j++)
-        if (op->sz <= (2 << j))
-          break;
-      size_t sz_ = 2 << j;
-      if (sz_ < PAGE_SIZE)
       // here is the checking ...
-        *(uintptr_t *)(op->addr+sz_-sizeof(uintptr_t)) = (uintptr_t)(op->addr);
-      else
-        *(uintptr_t *)(op->addr+op->sz-sizeof(uintptr_t)) = (uintptr_t)(op->addr);
+      *(uintptr_t *)(op->addr+kalloc_size(op->sz)-sizeof(uintptr_t)) = (uintptr_t)(op->addr);
       if (op->addr == NULL) {
         free(op);
       }
@@ -309,15 +303,7 @@ void restrict_test_body(int tid) {
     {
 #ifdef DEBUG
       assert(*(uintptr_t *)(op->addr) == (uintptr_t)(op->addr));
-      int j = 0;
-      for (; j < 32; j++)
-        if (malloc_pool[tid - 1][op->i]->sz <= (2 << j))
-          break;
-      size_t sz_ = 2 << j;
-      if (sz_ < PAGE_SIZE)
-        assert(*(uintptr_t *)(op->addr+sz_-sizeof(uintptr_t)) == (uintptr_t)(op->addr));
-      else
-        assert(*(uintptr_t *)(op->addr+malloc_pool[tid - 1][op->i]->sz-sizeof(uintptr_t)) == (uintptr_t)(op->addr));
+      assert(*(uintptr_t *)(op->addr+kalloc_size(malloc_pool[tid - 1][op->i]->sz)-sizeof(uintptr_t)) == (uintptr_t)(op->addr));
 #endif
       kfree(tid - 1, op->addr);
       free(malloc_pool[tid - 1][op->i]);
@@ -335,109 +321,241 @@ void restrict_test_body(int tid) {
 }
 
 
+void defer_stress_test_body(int tid) {
+  void *live[MAX_OP_NUM];
+  int n = 0;
+  kepoch_online(tid - 1);
+  for (int i = 0; i < (1 << 18); i++) {
+    if (n == 0 || (n < MAX_OP_NUM && rand() % 2)) {
+      live[n] = kalloc(tid - 1, rand() % (4 * PAGE_SIZE));
+      if (live[n] != NULL)
+        n++;
+    }
+    else {
+      int k = rand() % n;
+      kfree_deferred(tid - 1, live[k]);
+      live[k] = live[--n];
+    }
+    if (i % 64 == 0)
+      kepoch_quiescent(tid - 1);
+  }
+  while (n > 0)
+    kfree_deferred(tid - 1, live[--n]);
+  kepoch_offline(tid - 1);
+}
+
+// a burst of mid size blocks grows their chain and its cache; once the
+// chain sits idle, scavenging has to hand every page but the head back
+#define CACHE_BURST 2048
+#define CACHE_BURST_SZ 16384
+
+static void cache_stat(size_t *page_bytes) {
+  pmm_lock_all();
+  mem_stat *mp = memory_stat();
+  pmm_unlock_all();
+  *page_bytes = mp->page_bytes;
+  free(mp);
+}
+
+void cache_test_body(int tid) {
+  static void *burst[CACHE_BURST];
+  size_t before, peak, after;
+  // every small class gets its chain with its first block
+  for (int c = 0; c < FIRST_MID_CLASS; c++)
+    kfree(tid - 1, kalloc(tid - 1, class_size[c]));
+  cache_stat(&before);
+  for (int i = 0; i < CACHE_BURST; i++) {
+    burst[i] = kalloc(tid - 1, CACHE_BURST_SZ);
+    assert(burst[i] != NULL);
+  }
+  cache_stat(&peak);
+  for (int i = 0; i < CACHE_BURST; i++)
+    kfree(tid - 1, burst[i]);
+  for (int i = 0; i < 4 * KCACHE_PERIOD; i++)
+    kfree(tid - 1, kalloc(tid - 1, rand() % SMALL_MAX));
+  cache_stat(&after);
+  size_t head = BIG_SIZE(span_pages[size_class(CACHE_BURST_SZ)] * PAGE_SIZE);
+  printf("[CACHE] page_kib: before = %zu, burst = %zu, after = %zu\n",
+         before >> 10, peak >> 10, after >> 10);
+  assert(after <= before + head + BIG_SIZE(PAGE_SIZE));
+}
+
+static struct timespec test_start;
+
+// what the mix and restrict tests leave behind; `make coalesce` compares it
+// between the eager and the LAZY_COALESCE build
+static void frag_goodbye()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pmm_lock_all();
+  mem_stat *mp = memory_stat();
+  pmm_unlock_all();
+  printf("[FRAG] page_kib = %zu, small_free_nodes = %zu, big_free_nodes = %zu, elapsed = %.3fs\n",
+         mp->page_bytes >> 10, mp->small_free_nodes, mp->big_free_nodes,
+         (now.tv_sec - test_start.tv_sec) + (now.tv_nsec - test_start.tv_nsec) / 1e9);
+  free(mp);
+  goodbye();
+}
+
+// once every tid is offline, every deferred block must be back in the heap
+static void defer_goodbye()
+{
+  mem_stat *mp = memory_stat();
+  assert(mp->small_malloc_sz == mp->page_capacity);
+  assert(mp->big_malloc_sz + mp->page_bytes == HEAP_SIZE);
+  free(mp);
+  goodbye();
+}
+
 #ifdef BKL
 spinlock_t big_kernel_lk = (spinlock_t) {.locked = 0};
 #endif
 
-void perf_body(int tid) {
-  int i = 0;
-  struct malloc_op *op;
-  double sd = 0;
-  clock_t ct;
-  while (1) {
-    spin_lock(&lk[tid - 1]);
-    sd = rand() / (RAND_MAX + 1.0);
-    if (sd < 0.5)
-      op = random_op(tid, 0, 128);
-    else if (sd < 0.95)
-      op = random_op(tid, 4096, 0);
-    else
-      op = random_op(tid, PAGE_SIZE, 4*PAGE_SIZE);
-    if (op->type == OP_ALLOC)
-    {
-      ct = clock();
+/*
+    op streams for the perf modes
+
+    every thread replays a stream of STREAM_LEN ops generated before any
+    thread starts, from its own xorshift state seeded with STREAM_SEED and
+    its tid: the same build replays the same ops in every run, and the
+    replay loop does nothing but call the allocator and index two arrays.
+    no rand(), no harness malloc and no lk inside the timed region.
+
+    an op allocates into live[n++] or frees live[k], moving live[--n] into
+    its place, so the stream only has to track how many blocks are live.
+*/
+#define STREAM_LEN (1 << 18)
+#ifndef STREAM_SEED
+#define STREAM_SEED 0x9e3779b97f4a7c15ull
+#endif
+
+struct stream_op {
+  uint32_t type; // OP_ALLOC or OP_FREE
+  uint32_t arg;  // size to allocate, or live slot to free
+};
+
+// a stream draws its sizes from min_sz + [0, delta), picking a row with
+// probability pct percent
+struct size_mix {
+  int pct;
+  size_t min_sz, delta;
+};
+
+// what perf_body has always measured: mostly tiny and page sized blocks
+static const struct size_mix perf_mix[] = {
+  {50, 0, 128},
+  {45, 4096, 0},
+  { 5, PAGE_SIZE, 4*PAGE_SIZE},
+  { 0 },
+};
+
+static struct stream_op *streams[CPU_NUM];
+static double stream_sec[CPU_NUM];
+
+static inline uint64_t xorshift64(uint64_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static void gen_stream(int tid, const struct size_mix *mix) {
+  uint64_t x = STREAM_SEED * tid;
+  struct stream_op *ops = malloc(STREAM_LEN * sizeof(struct stream_op));
+  assert(ops != NULL);
+  int n = 0;
+  for (int i = 0; i < STREAM_LEN; i++) {
+    int alloc = n < MAX_OP_NUM && (n == 0 || xorshift64(&x) % 2 == OP_ALLOC);
+    if (alloc) {
+      int pct = xorshift64(&x) % 100;
+      const struct size_mix *m = mix;
+      while (pct >= m->pct && m[1].pct != 0)
+        pct -= (m++)->pct;
+      size_t sz = m->min_sz + (m->delta ? xorshift64(&x) % m->delta : 0);
+      ops[i] = (struct stream_op) {.type = OP_ALLOC, .arg = sz};
+      n++;
+    }
+    else {
+      ops[i] = (struct stream_op) {.type = OP_FREE, .arg = xorshift64(&x) % n};
+      n--;
+    }
+  }
+  streams[tid - 1] = ops;
+}
+
+static void gen_streams(int nr, const struct size_mix *mix) {
+  for (int i = 1; i <= nr; i++)
+    gen_stream(i, mix);
+}
+
+// runs tid's stream, calling the allocator only with call_allocator set.
+// nr counters, if any, count the replay loop alone and are read into val.
+static void replay(int tid, int call_allocator, struct counter *cnt, int nr, uint64_t *val) {
+  void *live[MAX_OP_NUM];
+  int n = 0;
+  struct stream_op *ops = streams[tid - 1];
+  struct timespec t0, t1;
+  counters_enable(cnt, nr);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < STREAM_LEN; i++) {
+    if (ops[i].type == OP_ALLOC) {
+      void *p = NULL;
+      if (call_allocator) {
 #ifdef BKL
-      spin_lock(&big_kernel_lk);
+        spin_lock(&big_kernel_lk);
 #endif
-      op->addr = kalloc(tid - 1, op->sz);
+        p = kalloc(tid - 1, ops[i].arg);
 #ifdef BKL
-      spin_unlock(&big_kernel_lk);
+        spin_unlock(&big_kernel_lk);
 #endif
-      clocks[tid-1] += (clock() - ct);
-      if (op->addr == NULL) {
-        free(op);
-      }
-      else {
-        malloc_pool[tid - 1][malloc_num[tid - 1]] = op;
-        malloc_num[tid - 1]++;
-        i++;
       }
+      live[n++] = p;
     }
-    else if (op->type == OP_FREE)
-    {
-      ct = clock();
+    else {
+      void *p = live[ops[i].arg];
+      live[ops[i].arg] = live[--n];
+      if (call_allocator && p != NULL) {
 #ifdef BKL
-      spin_lock(&big_kernel_lk);
+        spin_lock(&big_kernel_lk);
 #endif
-      kfree(tid - 1, op->addr);
+        kfree(tid - 1, p);
 #ifdef BKL
-      spin_unlock(&big_kernel_lk);
+        spin_unlock(&big_kernel_lk);
 #endif
-      clocks[tid-1] += (clock() - ct);
-      free(malloc_pool[tid - 1][op->i]);
-      malloc_pool[tid - 1][op->i] = malloc_pool[tid - 1][malloc_num[tid - 1] - 1];
-      malloc_num[tid - 1]--;
-      free(op);
-      i++;
+      }
     }
-    spin_unlock(&lk[tid - 1]);
-
-    if (i == (1<<18))
-      break;
   }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  counters_disable(cnt, nr);
+  counters_read(cnt, nr, val);
+  stream_sec[tid - 1] = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  while (call_allocator && n > 0)
+    if (live[--n] != NULL)
+      kfree(tid - 1, live[n]);
+  free(ops);
+  streams[tid - 1] = NULL;
+}
+
+void perf_body(int tid) {
+  replay(tid, 1, NULL, 0, NULL);
 }
 
+// the harness alone, to subtract from perf_body
 void perf_frame(int tid) {
-  int i = 0;
-  struct malloc_op *op;
-  double sd = 0;
-  clock_t ct;
-  while (1) {
-    spin_lock(&lk[tid - 1]);
-    sd = rand() / (RAND_MAX + 1.0);
-    if (sd < 0.5)
-      op = random_op(tid, 0, 128);
-    else if (sd < 0.95)
-      op = random_op(tid, 4096, 0);
-    else
-      op = random_op(tid, PAGE_SIZE, 4*PAGE_SIZE);
-    if (op->type == OP_ALLOC)
-    {
-      ct = clock();
-      // op->addr = kalloc(tid - 1, op->sz);
-      clocks[tid-1] += (clock() - ct);
+  replay(tid, 0, NULL, 0, NULL);
+}
 
-      malloc_pool[tid - 1][malloc_num[tid - 1]] = op;
-      malloc_num[tid - 1]++;
-      i++;
-  
-    }
-    else if (op->type == OP_FREE)
-    {
-      ct = clock();
-      // kfree(tid - 1, op->addr);
-      clocks[tid-1] += (clock() - ct);
-      free(malloc_pool[tid - 1][op->i]);
-      malloc_pool[tid - 1][op->i] = malloc_pool[tid - 1][malloc_num[tid - 1] - 1];
-      malloc_num[tid - 1]--;
-      free(op);
-      i++;
-    }
-    spin_unlock(&lk[tid - 1]);
+static int stream_threads;
 
-    if (i == (1<<18))
-      break;
+static void stream_report() {
+  double ops_per_sec = 0;
+  for (int i = 0; i < stream_threads; i++) {
+    printf("[CPU %d]: %d ops, %f s, %.1f ns/op\n", i, STREAM_LEN, stream_sec[i],
+           stream_sec[i] * 1e9 / STREAM_LEN);
+    ops_per_sec += STREAM_LEN / stream_sec[i];
   }
+  printf("[PERF] %d threads, %.0f ops/s\n", stream_threads, ops_per_sec);
+  goodbye();
 }
 
 void single_thread_small_memory_stress_test() {
@@ -479,14 +597,14 @@ void single_thread_mix_stress_test() {
   pmm_init();
   for (int i = 0; i < 1; i++)
     create(mix_stress_test_body);
-  join(goodbye);
+  join(frag_goodbye);
 }
 
 void muti_threads_mix_stress_test() {
   pmm_init();
   for (int i = 0; i < CPU_NUM; i++)
     create(mix_stress_test_body);
-  join(goodbye);
+  join(frag_goodbye);
 }
 
 void single_thread_restrict_test()
@@ -494,36 +612,613 @@ void single_thread_restrict_test()
   pmm_init();
   for (int i = 0; i < 1; i++)
     create(restrict_test_body);
-  join(goodbye);
+  join(frag_goodbye);
 }
 
 void muti_threads_restrict_test() {
   pmm_init();
   for (int i = 0; i < CPU_NUM; i++)
     create(restrict_test_body);
-  join(goodbye);
+  join(frag_goodbye);
 }
 
 void single_thread_perf() {
   pmm_init();
+  gen_streams(stream_threads = 1, perf_mix);
   create(perf_body);
-  join(goodbye);
+  join(stream_report);
 }
 
 void muti_threads_perf() {
   pmm_init();
+  gen_streams(stream_threads = CPU_NUM, perf_mix);
   for (int i = 0; i < CPU_NUM; i++)
     create(perf_body);
-  join(goodbye);
+  join(stream_report);
 }
 
 void muti_empty_cc() {
   pmm_init();
+  gen_streams(stream_threads = CPU_NUM, perf_mix);
   for (int i = 0; i < CPU_NUM; i++)
     create(perf_frame);
+  join(stream_report);
+}
+
+void muti_threads_defer_test() {
+  pmm_init();
+  for (int i = 0; i < CPU_NUM; i++)
+    create(defer_stress_test_body);
+  join(defer_goodbye);
+}
+
+void single_thread_cache_test() {
+  pmm_init();
+  create(cache_test_body);
   join(goodbye);
 }
 
+// a list one process builds in a file backed heap has to come back intact,
+// without being rebuilt, in the next one
+#define PERSIST_PATH "build/heap.img"
+#define PERSIST_SIZE (256u << 20)
+#define PERSIST_NODES 10000
+
+struct pnode {
+  struct pnode *next;
+  size_t val;
+};
+
+void persist_test() {
+  unlink(PERSIST_PATH);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fresh = pmm_open(PERSIST_PATH, PERSIST_SIZE);
+    assert(fresh == 0);
+    struct pnode *head = NULL;
+    for (size_t i = 0; i < PERSIST_NODES; i++) {
+      struct pnode *n = kalloc(i % CPU_NUM, sizeof(struct pnode) + rand() % (4 * PAGE_SIZE));
+      assert(n != NULL);
+      *n = (struct pnode) {.next = head, .val = i};
+      head = n;
+    }
+    kheap_set_root(head);
+    pmm_close();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  int loaded = pmm_open(PERSIST_PATH, PERSIST_SIZE);
+  assert(loaded == 1);
+  size_t n = PERSIST_NODES;
+  for (struct pnode *p = kheap_root(), *next; p != NULL; p = next) {
+    assert(p->val == --n);
+    next = p->next;
+    kfree(0, p);
+  }
+  assert(n == 0);
+  pmm_sync();
+  mem_stat *mp = memory_stat();
+  assert(mp->small_malloc_sz == mp->page_capacity && mp->big_obj_cnt == mp->page_num);
+  free(mp);
+  pmm_close();
+  unlink(PERSIST_PATH);
+  goodbye();
+}
+
+// kzalloc must hand out zeroes whether a block is fresh, recycled or merged
+// from both; every freed block is scribbled over first
+#define ZERO_LIVE 64
+
+static int all_zero(const char *p, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    if (p[i] != 0)
+      return 0;
+  return 1;
+}
+
+void zero_test_body(int tid) {
+  void *live[ZERO_LIVE] = {0};
+  size_t sz[ZERO_LIVE];
+  for (int i = 0; i < (1 << 12); i++) {
+    int k = rand() % ZERO_LIVE;
+    if (live[k] != NULL) {
+      memset(live[k], 0xa5, sz[k]);
+      kfree(tid - 1, live[k]);
+    }
+    // mostly BIGMEM blocks, some of them past the streaming threshold
+    sz[k] = rand() % 4 == 0 ? rand() % (4 * PAGE_SIZE) : rand() % (1 << 20);
+    if (rand() % 2) {
+      live[k] = kzalloc(tid - 1, sz[k]);
+      assert(live[k] != NULL && all_zero(live[k], sz[k]));
+    }
+    else {
+      live[k] = kalloc(tid - 1, sz[k]);
+      assert(live[k] != NULL);
+    }
+    memset(live[k], 0x5a, sz[k]);
+  }
+  for (int k = 0; k < ZERO_LIVE; k++)
+    if (live[k] != NULL)
+      kfree(tid - 1, live[k]);
+  assert(kcalloc(tid - 1, SIZE_MAX / 2, 4) == NULL);
+  // no overflow, but far more than any heap holds
+  assert(kcalloc(tid - 1, 1, SIZE_MAX - 8) == NULL);
+  assert(kcalloc(tid - 1, SIZE_MAX / 16, 8) == NULL);
+  assert(kcalloc(tid - 1, 2, KALLOC_MAX / 2 + 1) == NULL);
+  char *p = kcalloc(tid - 1, 1000, 1000);
+  assert(p != NULL && all_zero(p, 1000 * 1000));
+  kfree(tid - 1, p);
+}
+
+void single_thread_zero_test() {
+  pmm_init();
+  create(zero_test_body);
+  join(goodbye);
+}
+
+// a big working set freed while the scavenger runs has to leave the
+// resident set once its shard sits idle, and read back as zero after
+#define SCAV_BLOCKS 64
+#define SCAV_SZ (1 << 20)
+
+static size_t rss_kib() {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  assert(f != NULL);
+  int n = fscanf(f, "%*s %ld", &pages);
+  assert(n == 1);
+  fclose(f);
+  return pages * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+void scavenger_test() {
+  static void *blk[SCAV_BLOCKS];
+  pmm_init();
+  for (int i = 0; i < SCAV_BLOCKS; i++) {
+    blk[i] = kalloc(0, SCAV_SZ);
+    assert(blk[i] != NULL);
+    memset(blk[i], 0x5a, SCAV_SZ);
+  }
+  size_t peak = rss_kib();
+  for (int i = 0; i < SCAV_BLOCKS; i++)
+    kfree(0, blk[i]);
+  int err = kscav_start(5, 50);
+  assert(err == 0);
+  size_t now = peak;
+  for (int i = 0; i < 400 && now + (SCAV_BLOCKS * SCAV_SZ >> 11) > peak; i++) {
+    usleep(5000);
+    now = rss_kib();
+  }
+  printf("[SCAVENGE] rss_kib: peak = %zu, idle = %zu\n", peak, now);
+  assert(now + (SCAV_BLOCKS * SCAV_SZ >> 11) <= peak);
+  // the rounds that saw the shard idle saw every block back
+  mem_stat ms;
+  assert(kscav_stat(&ms) && ms.big_malloc_sz + ms.page_bytes == HEAP_SIZE);
+  char *p = kzalloc(0, SCAV_BLOCKS * SCAV_SZ / 2);
+  assert(p != NULL && all_zero(p, SCAV_BLOCKS * SCAV_SZ / 2));
+  // after a restart the statistics are those of the new thread's rounds,
+  // which see p
+  kscav_stop();
+  err = kscav_start(5, 50);
+  assert(err == 0);
+  while (!kscav_stat(&ms))
+    usleep(1000);
+  assert(ms.big_malloc_sz + ms.page_bytes + SCAV_BLOCKS * SCAV_SZ / 2 <= HEAP_SIZE);
+  kfree(0, p);
+  kscav_stop();
+  goodbye();
+}
+
+// short lived threads take turns on the tids and leave small blocks for
+// the main thread to free: the next thread's chains have to adopt the
+// orphaned pages instead of the heap growing by a page set per thread
+#define CHURN_ROUNDS 64
+#define CHURN_OBJS 2048
+#define CHURN_LEFT 256
+
+static void *churn_left[CHURN_LEFT];
+
+static void *churn_body(void *arg) {
+  int tid = (int)(intptr_t)arg;
+  static __thread void *blk[CHURN_OBJS];
+  int err = kthread_attach(tid);
+  assert(err == 0);
+  for (int i = 0; i < CHURN_OBJS; i++) {
+    size_t sz = 16 + rand() % 240;
+    blk[i] = kalloc(tid, sz);
+    assert(blk[i] != NULL);
+    memset(blk[i], 0x5a, sz);
+  }
+  for (int i = 0; i < CHURN_OBJS; i++) {
+    if (i % (CHURN_OBJS / CHURN_LEFT) == 0)
+      churn_left[i / (CHURN_OBJS / CHURN_LEFT)] = blk[i];
+    else
+      kfree(tid, blk[i]);
+  }
+  // a mid-size chain and the large block cache are cleaned up as well
+  kfree(tid, kalloc(tid, 3 * PAGE_SIZE));
+  kfree(tid, kalloc(tid, 16 * PAGE_SIZE));
+  return NULL;
+}
+
+void thread_churn_test() {
+  pmm_init();
+  size_t first = 0, most = 0;
+  for (int r = 0; r < CHURN_ROUNDS; r++) {
+    pthread_t t;
+    pthread_create(&t, NULL, churn_body, (void *)(intptr_t)(r % CPU_NUM));
+    pthread_join(t, NULL);
+    mem_stat *mp = memory_stat();
+    // only orphans are left, each holding a block for main to free
+    assert(mp->orphan_pages == mp->page_num && mp->page_num > 0);
+    if (r == 0)
+      first = mp->page_num;
+    most = mp->page_num > most ? mp->page_num : most;
+    free(mp);
+    for (int i = 0; i < CHURN_LEFT; i++)
+      kfree(0, churn_left[i]);
+  }
+  printf("[CHURN] pages: first = %zu, most = %zu\n", first, most);
+  assert(most <= 2 * first);
+  kfree_orphans();
+  mem_stat *mp = memory_stat();
+  assert(mp->page_num == 0 && mp->big_malloc_sz == HEAP_SIZE);
+  free(mp);
+  goodbye();
+}
+
+// kalloc_inline with constant sizes has to hand out the same blocks kalloc
+// would, mixed freely with kalloc/kfree, and cost less per op
+#define INLINE_LIVE 4096
+#define INLINE_OPS (1 << 22)
+
+struct inline_obj {
+  void *a, *b;
+  uint32_t c;
+};
+
+static double inline_loop(int fast) {
+  static void *live[INLINE_LIVE];
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < INLINE_OPS; i++) {
+    int k = i % INLINE_LIVE;
+    if (live[k] != NULL)
+      fast ? kfree_inline(0, live[k]) : kfree(0, live[k]);
+    live[k] = fast ? kalloc_inline(0, sizeof(struct inline_obj)) : kalloc(0, sizeof(struct inline_obj));
+    ((struct inline_obj *)live[k])->c = i;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (int k = 0; k < INLINE_LIVE; k++) {
+    kfree(0, live[k]);
+    live[k] = NULL;
+  }
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / INLINE_OPS;
+}
+
+void inline_test() {
+  static void *blk[INLINE_LIVE];
+  pmm_init();
+  for (int i = 0; i < INLINE_LIVE; i++) {
+    blk[i] = i % 3 ? kalloc_inline(0, 48) : kalloc(0, 48);
+    alloc_header *ah = (alloc_header *)blk[i] - 1;
+    assert(blk[i] != NULL && ah->magic == 0x6d616c63 && ah->len == kalloc_size(48) && ah->slot != 0);
+    memset(blk[i], 0x5a, 48);
+  }
+  for (int i = 0; i < INLINE_LIVE; i++)
+    i % 2 ? kfree_inline(0, blk[i]) : kfree(0, blk[i]);
+  // misses: a run time size, a mid-size and a big constant
+  size_t n = 48 + rand() % 2;
+  void *p = kalloc_inline(0, n), *q = kalloc_inline(0, 3 * PAGE_SIZE), *r = kalloc_inline(0, 1 << 20);
+  assert(p != NULL && q != NULL && r != NULL);
+  kfree_inline(0, p);
+  kfree_inline(0, q);
+  kfree_inline(0, r);
+  // kfree_sized takes the same paths by the size asked for
+  size_t sz[] = {1, 48, SMALL_MAX, SMALL_MAX + 1, 3 * PAGE_SIZE, MID_MAX + 1, 1 << 20, 64 << 20};
+  for (int i = 0; i < sizeof(sz) / sizeof(sz[0]); i++) {
+    p = kalloc(0, sz[i]);
+    assert(p != NULL);
+    kfree_sized(0, p, sz[i]);
+  }
+  double slow = inline_loop(0), fast = inline_loop(1);
+  printf("[INLINE] kalloc/kfree: %.1f ns/op, inline: %.1f ns/op\n", slow, fast);
+  mem_stat *mp = memory_stat();
+  assert(mp->small_malloc_sz == mp->page_capacity);
+  free(mp);
+  goodbye();
+}
+
+#ifdef KTRACE
+// every allocation and free of a multi-threaded run, remote frees and
+// deferred ones included, has to reach the trace file, and the file has to
+// replay against a fresh heap with every free finding its allocation
+#define TRACE_PATH "build/trace.bin"
+#define TRACE_OPS 20000
+#define TRACE_LIVE 256
+
+static void *trace_shared[CPU_NUM][TRACE_LIVE];
+
+void trace_test_body(int tid) {
+  void *live[TRACE_LIVE] = {0};
+  kepoch_online(tid - 1);
+  for (int i = 0; i < TRACE_OPS; i++) {
+    int k = rand() % TRACE_LIVE;
+    if (live[k] != NULL) {
+      if (k % 8 == 0)
+        kfree_deferred(tid - 1, live[k]);
+      else
+        kfree_inline(tid - 1, live[k]);
+    }
+    size_t sz = rand() % 4 == 0 ? rand() % (4 * PAGE_SIZE) : rand() % 256;
+    live[k] = k % 2 ? kalloc(tid - 1, sz) : kzalloc(tid - 1, sz);
+    assert(live[k] != NULL);
+    if (i % 64 == 0)
+      kepoch_quiescent(tid - 1);
+  }
+  kepoch_offline(tid - 1);
+  // the next thread's blocks are freed from here
+  memcpy(trace_shared[tid - 1], live, sizeof(live));
+}
+
+static void trace_goodbye() {
+  for (int i = 0; i < CPU_NUM; i++)
+    for (int k = 0; k < TRACE_LIVE; k++)
+      kfree(i, trace_shared[(i + 1) % CPU_NUM][k]);
+  ktrace_stat st;
+  int err = ktrace_stop(&st);
+  assert(err == 0);
+  printf("[TRACE] events = %lu, dropped = %lu\n", st.events, st.dropped);
+  assert(st.dropped == 0 && st.events >= CPU_NUM * (2 * TRACE_OPS - TRACE_LIVE));
+  // the heap after the run and after the replay: nothing left in either
+  mem_stat *mp = memory_stat();
+  assert(mp->small_malloc_sz == mp->page_capacity);
+  free(mp);
+  long unmatched;
+  long replayed = ktrace_replay(TRACE_PATH, &unmatched);
+  assert(replayed == st.events && unmatched == 0);
+  mp = memory_stat();
+  assert(mp->small_malloc_sz == mp->page_capacity);
+  free(mp);
+  goodbye();
+}
+
+void trace_test() {
+  pmm_init();
+  int err = ktrace_start(TRACE_PATH);
+  assert(err == 0);
+  for (int i = 0; i < CPU_NUM; i++)
+    create(trace_test_body);
+  join(trace_goodbye);
+}
+#endif
+
+// heaps of pmm_create() share nothing with each other or kmem_default:
+// every thread churns its own blocks on two of them, each block has to
+// stay inside the area of its heap, and emptying one heap or dropping
+// another with blocks still in it leaves the rest as they were
+#define HEAPS_SIZE (64u << 20)
+#define HEAPS_OPS 20000
+#define HEAPS_LIVE 256
+
+static kmem_heap *heaps[2];
+
+static inline int in_heap(kmem_heap *h, void *p) {
+  return p > h->area.start && p < h->area.end;
+}
+
+void heaps_test_body(int tid) {
+  void *live[2][HEAPS_LIVE] = {0};
+  for (int i = 0; i < HEAPS_OPS; i++) {
+    int k = rand() % HEAPS_LIVE, w = i % 2;
+    kmem_heap *h = heaps[w];
+    if (live[w][k] != NULL)
+      kfree_heap(h, tid - 1, live[w][k]);
+    size_t sz = rand() % 4 == 0 ? rand() % (4 * PAGE_SIZE) : rand() % 256;
+    live[w][k] = kzalloc_heap(h, tid - 1, sz);
+    assert(live[w][k] != NULL && in_heap(h, live[w][k]) && !in_heap(heaps[!w], live[w][k]));
+    for (size_t j = 0; j < sz; j++)
+      assert(((char *)live[w][k])[j] == 0);
+    memset(live[w][k], 0x5a, sz);
+  }
+  // heaps[1] goes with these still allocated
+  for (int k = 0; k < HEAPS_LIVE; k++)
+    if (live[0][k] != NULL)
+      kfree_heap(heaps[0], tid - 1, live[0][k]);
+}
+
+static void heaps_goodbye() {
+  mem_stat ms;
+  memory_stat_fill(heaps[0], &ms);
+  assert(ms.small_malloc_sz == ms.page_capacity);
+  memory_stat_fill(heaps[1], &ms);
+  assert(ms.small_malloc_sz < ms.page_capacity);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pmm_destroy(heaps[1]);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  printf("[HEAPS] destroy with blocks live: %.1f us\n",
+         ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e3);
+  // the default heap was never touched, heaps[0] carries on
+  mem_stat *mp = memory_stat();
+  assert(mp->page_num == 0 && mp->big_malloc_sz == HEAP_SIZE);
+  free(mp);
+  void *p = kalloc_heap(heaps[0], 0, 1 << 20);
+  assert(p != NULL && in_heap(heaps[0], p));
+  kfree_heap(heaps[0], 0, p);
+  pmm_destroy(heaps[0]);
+  goodbye();
+}
+
+void heaps_test() {
+  pmm_init();
+  for (int i = 0; i < 2; i++) {
+    heaps[i] = pmm_create(HEAPS_SIZE);
+    assert(heaps[i] != NULL);
+  }
+  for (int i = 0; i < CPU_NUM; i++)
+    create(heaps_test_body);
+  join(heaps_goodbye);
+}
+
+// blocks bigger than a BIGMEM shard run over several: the largest one is
+// about the heap, and freeing them gives every shard its whole range back
+static void huge_check_free() {
+  mem_stat *mp = memory_stat();
+  assert(mp->big_malloc_sz == HEAP_SIZE && mp->big_obj_cnt == 0);
+  assert(mp->big_free_nodes == kmem_default.nr_shards);
+  free(mp);
+}
+
+void huge_block_test() {
+  pmm_init();
+  size_t most = HEAP_SIZE - PAGE_SIZE;
+  char *p = kalloc(0, most);
+  assert(p != NULL);
+  p[0] = p[most / 2] = p[most - 1] = 1;
+  kfree(0, p);
+  huge_check_free();
+  assert(kalloc(0, HEAP_SIZE) == NULL);
+  // sizes whose rounding up would wrap to a few pages
+  assert(kalloc(0, SIZE_MAX) == NULL && kzalloc(0, SIZE_MAX - 8) == NULL);
+  assert(kalloc(0, SIZE_MAX - PAGE_SIZE) == NULL && kalloc(0, (size_t)UINT32_MAX + 1) == NULL);
+
+  // side by side, and next to blocks of the ordinary paths
+  char *a = kzalloc(0, 300u << 20), *b = kalloc(1, 400u << 20), *c = kalloc(2, 200u << 20);
+  char *small = kalloc(3, 64), *mid = kalloc(3, 3 * PAGE_SIZE);
+  assert(a != NULL && b != NULL && c != NULL && small != NULL && mid != NULL);
+  assert(a[0] == 0 && a[150u << 20] == 0 && a[(300u << 20) - 1] == 0);
+  assert(a + (300u << 20) <= b || b + (400u << 20) <= a);
+  memset(b, 0x5a, 400u << 20);
+  kfree(1, b);
+  kfree_deferred(0, a);
+  kepoch_offline(0);
+  kfree(2, c);
+  kfree(3, small);
+  kfree(3, mid);
+  kthread_exit(3);
+  huge_check_free();
+  printf("[HUGE] %d shards of %zu MiB, largest block %zu MiB\n",
+         kmem_default.nr_shards, kmem_default.shard_span >> 20, most >> 20);
+  goodbye();
+}
+
+/*
+    hardware counter gate (make perfcheck)
+
+    replays the small, big and mixed size streams on one thread and reads
+    instructions, cycles, L1D/LLC misses and branch misses per op for each.
+    `build/test 15 <file> record` (make perfbaseline) writes them to the
+    baseline file, every other run compares against it and fails when a
+    counter grew by more than PERF_TOLERANCE, or when there is no baseline
+    to compare with. counters the machine does not expose (common in VMs)
+    print as "-" and are not checked; without any, the gate passes with a
+    note.
+*/
+#ifndef PERF_TOLERANCE
+#define PERF_TOLERANCE 0.05
+#endif
+
+static const struct size_mix small_mix[] = {{100, 0, 128}, {0}};
+static const struct size_mix big_mix[] = {{100, PAGE_SIZE, 4*PAGE_SIZE}, {0}};
+static const struct size_mix mixed_mix[] = {{100, 0, 4*PAGE_SIZE}, {0}};
+
+static const struct {
+  const char *name;
+  const struct size_mix *mix;
+} perf_loops[] = {
+  {"small", small_mix},
+  {"big", big_mix},
+  {"mixed", mixed_mix},
+};
+
+#define NR_PERF_LOOPS (sizeof(perf_loops) / sizeof(perf_loops[0]))
+
+static struct counter perf_counters[] = {
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "l1d_miss",     PERF_TYPE_HW_CACHE,
+    HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  { "llc_miss",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "branch_miss",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+#define NR_PERF_COUNTERS (sizeof(perf_counters) / sizeof(perf_counters[0]))
+
+// the baseline's value for loop/counter, -1 if it has none
+static double baseline_of(FILE *f, const char *loop, const char *counter) {
+  char l[32], c[32];
+  double v;
+  rewind(f);
+  while (fscanf(f, "%31s %31s %lf", l, c, &v) == 3)
+    if (strcmp(l, loop) == 0 && strcmp(c, counter) == 0)
+      return v;
+  return -1;
+}
+
+void perf_check(const char *path, int record) {
+  double per_op[NR_PERF_LOOPS][NR_PERF_COUNTERS];
+  uint64_t val[NR_PERF_COUNTERS];
+  pmm_init();
+  int opened = counters_open(perf_counters, NR_PERF_COUNTERS);
+  for (int i = 0; i < NR_PERF_LOOPS; i++) {
+    gen_stream(1, perf_loops[i].mix);
+    replay(1, 1, perf_counters, NR_PERF_COUNTERS, val);
+    for (int j = 0; j < NR_PERF_COUNTERS; j++)
+      per_op[i][j] = val[j] == COUNTER_NA ? -1 : (double)val[j] / STREAM_LEN;
+  }
+  counters_close(perf_counters, NR_PERF_COUNTERS);
+  if (opened == 0) {
+    printf("[PERFCHECK] no hardware counters available, nothing to check\n");
+    goodbye();
+    return;
+  }
+
+  FILE *base = record ? NULL : fopen(path, "r");
+  FILE *out = record ? fopen(path, "w") : NULL;
+  if (base == NULL && out == NULL) {
+    printf("[PERFCHECK] cannot %s %s, run make perfbaseline to record one\n",
+           record ? "write" : "read", path);
+    exit(1);
+  }
+  int regressed = 0;
+  printf("loop\tcounter\tper_op\tbaseline\tchange\n");
+  for (int i = 0; i < NR_PERF_LOOPS; i++) {
+    for (int j = 0; j < NR_PERF_COUNTERS; j++) {
+      const char *loop = perf_loops[i].name, *counter = perf_counters[j].name;
+      if (per_op[i][j] < 0) {
+        printf("%s\t%s\t-\n", loop, counter);
+        continue;
+      }
+      if (out != NULL)
+        fprintf(out, "%s\t%s\t%.3f\n", loop, counter, per_op[i][j]);
+      double b = base ? baseline_of(base, loop, counter) : -1;
+      if (b <= 0) {
+        printf("%s\t%s\t%.3f\n", loop, counter, per_op[i][j]);
+        continue;
+      }
+      double change = per_op[i][j] / b - 1;
+      int bad = change > PERF_TOLERANCE;
+      regressed |= bad;
+      printf("%s\t%s\t%.3f\t%.3f\t%+.1f%%%s\n", loop, counter, per_op[i][j], b,
+             change * 100, bad ? "\tREGRESSED" : "");
+    }
+  }
+  if (out != NULL) {
+    fclose(out);
+    printf("[PERFCHECK] baseline written to %s\n", path);
+  }
+  if (base != NULL)
+    fclose(base);
+  if (regressed) {
+    printf("[PERFCHECK] per-op cost grew by more than %.0f%% over %s\n", PERF_TOLERANCE * 100, path);
+    exit(1);
+  }
+  goodbye();
+}
+
 void gen_workload(int tid) {
   struct malloc_op *op = NULL;
   double sd = 0;
@@ -570,6 +1265,7 @@ int main(int argc, char *argv[])
   {
     spin_init(&lk[i]);
   }
+  clock_gettime(CLOCK_MONOTONIC, &test_start);
   switch (atoi(argv[1]))
   {
   case 1:
@@ -605,6 +1301,42 @@ int main(int argc, char *argv[])
   case 11:
     muti_empty_cc();
     break;
+  case 12:
+    muti_threads_defer_test();
+    break;
+  case 13:
+    single_thread_cache_test();
+    break;
+  case 14:
+    persist_test();
+    break;
+  case 15:
+    perf_check(argc > 2 ? argv[2] : "bench/perf-baseline.tsv",
+               argc > 3 && strcmp(argv[3], "record") == 0);
+    break;
+  case 16:
+    single_thread_zero_test();
+    break;
+  case 17:
+    scavenger_test();
+    break;
+  case 18:
+    thread_churn_test();
+    break;
+  case 19:
+    inline_test();
+    break;
+#ifdef KTRACE
+  case 20:
+    trace_test();
+    break;
+#endif
+  case 21:
+    heaps_test();
+    break;
+  case 22:
+    huge_block_test();
+    break;
   default:
     assert(0);
   }
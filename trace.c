@@ -0,0 +1,329 @@
+#ifdef KTRACE
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pmm.h"
+
+/*
+    allocation event trace, built with -DKTRACE
+
+    while ktrace_start() has a trace running, kalloc/kfree and friends
+    append one ktrace_event to the ring of the calling tid. several threads
+    may share a tid, so a ring is a bounded multi-producer queue: a
+    producer claims a slot with a CAS on head, fills it and publishes it
+    through the slot's seq; a full ring drops the event and counts it. the
+    drain thread copies published events into a KTRACE_CHUNK buffer and
+    writes it out whole, so the file grows by large sequential writes.
+
+    with no trace running, a call pays one relaxed load and a branch that
+    is predicted not taken; the inline fast paths fall back to kalloc/kfree
+    then, and those emit.
+
+    file format, native endianness:
+
+      ktrace_file_header
+      ktrace_event ...
+
+    events of one ring are in order, events of different rings interleave
+    in chunks: sort by ts (a stable sort keeps each ring's order) before
+    replaying. a free is stamped before the block is given back and an
+    allocation after it was taken, so a block handed out again sorts after
+    the free that released it. ts are TSC ticks; ts0/ns0 and ts1/ns1 taken
+    at start and stop convert them to CLOCK_MONOTONIC nanoseconds.
+*/
+
+#define KTRACE_RING (1 << 16)          // events per tid, a power of two
+#define KTRACE_CHUNK (1 << 15)         // events per write()
+#define KTRACE_IDLE_US 1000            // wait of the drain thread on empty rings
+#define KTRACE_MAGIC 0x6b6d615f74726365ul // kma_trce
+
+typedef struct {
+  uint64_t seq;  // claimed position + 1 once the event is in
+  ktrace_event ev;
+} ktrace_slot;
+
+typedef struct {
+  uint64_t head __attribute__((aligned(CACHELINE_SIZE))); // claimed by producers
+  uint64_t dropped;
+  uint64_t tail __attribute__((aligned(CACHELINE_SIZE))); // drained up to
+  ktrace_slot slot[KTRACE_RING];
+} ktrace_ring;
+
+int ktrace_on;
+
+static ktrace_ring rings[CPU_NUM];
+static int trace_fd = -1;
+static pthread_t drain_thread;
+static int draining;
+static ktrace_file_header file_header;
+static ktrace_event chunk[KTRACE_CHUNK];
+static int chunk_n;
+static uint64_t written;
+static int write_err;
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void ktrace_emit(int op, int tid, void *ptr, size_t size) {
+  ktrace_ring *r = &rings[tid];
+  alloc_header *ah = (alloc_header *)((uintptr_t)ptr - sizeof(alloc_header));
+  uint64_t h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  do {
+    if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= KTRACE_RING) {
+      __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&r->head, &h, h + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  ktrace_slot *s = &r->slot[h & (KTRACE_RING - 1)];
+  s->ev = (ktrace_event) {
+    .ts = __builtin_ia32_rdtsc(),
+    .ptr = (uintptr_t)ptr,
+    .size = size,
+    .op = op,
+    .cls = size <= MID_MAX ? size_class(size) : KTRACE_BIG,
+    .owner = ah->cpu_id,
+    .cpu = tid,
+  };
+  __atomic_store_n(&s->seq, h + 1, __ATOMIC_RELEASE);
+}
+
+// a chunk that cannot be written is lost, the trace goes on
+static void flush_chunk() {
+  size_t left = chunk_n * sizeof(ktrace_event);
+  for (char *p = (char *)chunk; left > 0; ) {
+    ssize_t n = write(trace_fd, p, left);
+    if (n <= 0) {
+      write_err = 1;
+      chunk_n = 0;
+      return;
+    }
+    p += n;
+    left -= n;
+  }
+  written += chunk_n;
+  chunk_n = 0;
+}
+
+// moves the published events of every ring into chunk, writing it out
+// whenever it fills up; returns how many were moved
+static uint64_t drain_pass() {
+  uint64_t moved = 0;
+  for (int i = 0; i < CPU_NUM; i++) {
+    ktrace_ring *r = &rings[i];
+    uint64_t t = r->tail;
+    for (;; t++) {
+      ktrace_slot *s = &r->slot[t & (KTRACE_RING - 1)];
+      if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != t + 1)
+        break;
+      chunk[chunk_n++] = s->ev;
+      if (chunk_n == KTRACE_CHUNK)
+        flush_chunk();
+      moved++;
+    }
+    __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+  }
+  return moved;
+}
+
+static void *drain_main(void *arg) {
+  while (__atomic_load_n(&draining, __ATOMIC_ACQUIRE))
+    if (drain_pass() == 0)
+      usleep(KTRACE_IDLE_US);
+  return NULL;
+}
+
+// traces every allocation and free into path until ktrace_stop(). 0 on
+// success, -1 when a trace runs already or the file or thread cannot be had
+int ktrace_start(const char *path) {
+  if (trace_fd >= 0)
+    return -1;
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (trace_fd < 0)
+    return -1;
+  for (int i = 0; i < CPU_NUM; i++) {
+    rings[i].head = rings[i].tail = rings[i].dropped = 0;
+    for (int j = 0; j < KTRACE_RING; j++)
+      rings[i].slot[j].seq = 0;
+  }
+  file_header = (ktrace_file_header) {
+    .magic = KTRACE_MAGIC,
+    .version = KTRACE_VERSION,
+    .event_size = sizeof(ktrace_event),
+    .cpu_num = CPU_NUM,
+    .ts0 = __builtin_ia32_rdtsc(),
+    .ns0 = now_ns(),
+  };
+  chunk_n = 0;
+  written = 0;
+  write_err = 0;
+  draining = 1;
+  // rewritten with the totals by ktrace_stop()
+  if (write(trace_fd, &file_header, sizeof(file_header)) != sizeof(file_header) ||
+      pthread_create(&drain_thread, NULL, drain_main, NULL) != 0) {
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+  __atomic_store_n(&ktrace_on, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// writes out what is left and closes the file. st, if given, gets the
+// totals. returns -1 if a write failed.
+int ktrace_stop(ktrace_stat *st) {
+  if (trace_fd < 0)
+    return -1;
+  __atomic_store_n(&ktrace_on, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&draining, 0, __ATOMIC_RELEASE);
+  pthread_join(drain_thread, NULL);
+  // producers that saw the trace on may still be filling their slot
+  for (int i = 0; i < CPU_NUM; i++)
+    while (__atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE) != rings[i].tail)
+      drain_pass();
+  if (chunk_n > 0)
+    flush_chunk();
+  int err = write_err ? -1 : 0;
+  file_header.ts1 = __builtin_ia32_rdtsc();
+  file_header.ns1 = now_ns();
+  file_header.events = written;
+  for (int i = 0; i < CPU_NUM; i++)
+    file_header.dropped += rings[i].dropped;
+  if (pwrite(trace_fd, &file_header, sizeof(file_header), 0) != sizeof(file_header))
+    err = -1;
+  close(trace_fd);
+  trace_fd = -1;
+  if (st != NULL)
+    *st = (ktrace_stat) {.events = written, .dropped = file_header.dropped};
+  return err;
+}
+
+// ============== replay ===============
+
+struct replay_map {
+  uint64_t *key;   // traced pointer, 0: empty
+  void **val;
+  size_t mask;
+};
+
+static inline size_t replay_home(struct replay_map *m, uint64_t key) {
+  return ((key >> 4) * 0x9e3779b97f4a7c15ull >> 32) & m->mask;
+}
+
+// where key is, or the empty slot it would go to
+static size_t replay_find(struct replay_map *m, uint64_t key) {
+  size_t i = replay_home(m, key);
+  while (m->key[i] != 0 && m->key[i] != key)
+    i = (i + 1) & m->mask;
+  return i;
+}
+
+// backward shift deletion keeps the probe sequences intact
+static void replay_erase(struct replay_map *m, size_t i) {
+  for (size_t j = (i + 1) & m->mask; m->key[j] != 0; j = (j + 1) & m->mask) {
+    size_t home = replay_home(m, m->key[j]);
+    if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+      m->key[i] = m->key[j];
+      m->val[i] = m->val[j];
+      i = j;
+    }
+  }
+  m->key[i] = 0;
+}
+
+static int by_ts(const void *a, const void *b) {
+  const ktrace_event *ea = a, *eb = b;
+  if (ea->ts != eb->ts)
+    return ea->ts < eb->ts ? -1 : 1;
+  // qsort is not stable: the position in the file breaks ties, which keeps
+  // each ring's order
+  return ea < eb ? -1 : ea > eb;
+}
+
+// runs the allocations and frees of a trace file against this heap, on the
+// tids they were traced on, in ts order. frees of blocks allocated before
+// the trace started are skipped and counted in *unmatched, and so is an
+// allocation of an address still live, whose free a full ring dropped: the
+// stale block is freed and the new one takes its place. blocks still live
+// at the end of the trace are freed. returns the events replayed, -1 when
+// the file cannot be read or is of another format, or memory runs out.
+long ktrace_replay(const char *path, long *unmatched) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  ktrace_file_header fh;
+  if (read(fd, &fh, sizeof(fh)) != sizeof(fh) || fh.magic != KTRACE_MAGIC ||
+      fh.version != KTRACE_VERSION || fh.event_size != sizeof(ktrace_event)) {
+    close(fd);
+    return -1;
+  }
+  // the count comes from the file: keep the sizes below from wrapping
+  ktrace_event *ev = NULL;
+  if (fh.events < SIZE_MAX / 2 / sizeof(ktrace_event))
+    ev = malloc(fh.events * sizeof(ktrace_event) + 1);
+  if (ev == NULL) {
+    close(fd);
+    return -1;
+  }
+  size_t want = fh.events * sizeof(ktrace_event);
+  ssize_t got = 0;
+  for (ssize_t n; (size_t)got < want && (n = read(fd, (char *)ev + got, want - got)) > 0; )
+    got += n;
+  close(fd);
+  if ((size_t)got != want) {
+    free(ev);
+    return -1;
+  }
+  qsort(ev, fh.events, sizeof(ktrace_event), by_ts);
+
+  struct replay_map m = {.mask = 1023};
+  while (m.mask < fh.events * 2)
+    m.mask = m.mask * 2 + 1;
+  m.key = calloc(m.mask + 1, sizeof(uint64_t));
+  m.val = calloc(m.mask + 1, sizeof(void *));
+  long replayed = 0, skipped = 0;
+  if (m.key == NULL || m.val == NULL)
+    replayed = -1;
+  for (uint64_t k = 0; replayed >= 0 && k < fh.events; k++) {
+    ktrace_event *e = &ev[k];
+    int tid = e->cpu % CPU_NUM;
+    size_t i = replay_find(&m, e->ptr);
+    if (e->op == KT_ALLOC || e->op == KT_ZALLOC) {
+      void *p = e->op == KT_ALLOC ? kalloc(tid, e->size) : kzalloc(tid, e->size);
+      if (p == NULL) {
+        replayed = -1;
+        break;
+      }
+      if (m.key[i] != 0) {
+        kfree(tid, m.val[i]);
+        skipped++;
+      }
+      m.key[i] = e->ptr;
+      m.val[i] = p;
+    }
+    else if (m.key[i] == 0) {
+      skipped++;
+      continue;
+    }
+    else {
+      kfree(tid, m.val[i]);
+      replay_erase(&m, i);
+    }
+    replayed++;
+  }
+  for (size_t i = 0; m.key != NULL && m.val != NULL && i <= m.mask; i++)
+    if (m.key[i] != 0)
+      kfree(0, m.val[i]);
+  free(m.key);
+  free(m.val);
+  free(ev);
+  if (unmatched != NULL)
+    *unmatched = skipped;
+  return replayed;
+}
+#endif